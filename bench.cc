@@ -0,0 +1,458 @@
+// End to end benchmark: runs `channel -s` on loopback, feeds it synthetic lines and reads them back with many
+// clients. Prints one JSON line per scenario so runs can be compared by a script.
+//
+// make bench
+// ./channel_bench -n 1,16 -m drop -s 200 -r 100000 -B 10
+
+#include "config.h"
+#include "log.h"
+#include "utils.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct BenchOptions {
+  const char *channel{"./channel"};
+  uint16_t port{kDefaultPort + 1};
+  std::vector<uint32_t> clients{1, 16, 256, 1000};
+  // server drop mode for each entry, false runs it with -d
+  std::vector<bool> drop_modes{true, false};
+  // bytes per line including the newline
+  uint32_t line_size{100};
+  // lines per second, 0 writes as fast as the server takes them
+  uint64_t rate{0};
+  // lines written back to back before pacing kicks in
+  uint32_t burst{1};
+  int64_t duration_ms{2000};
+  // client reader threads, 0 for one per core
+  uint32_t threads{0};
+  // server sender threads
+  uint32_t senders{1};
+  // run the server with -U
+  bool is_uring{false};
+};
+
+// Scenario outcome, one JSON line.
+struct BenchResult {
+  uint32_t clients{0};
+  uint32_t connected{0};
+  bool is_drop{true};
+  uint64_t sent_lines{0};
+  double generate_seconds{0};
+  double seconds{0};
+  uint64_t recv_lines{0};
+  uint64_t recv_bytes{0};
+  Hist::Snapshot latency;
+
+  std::string to_json(const BenchOptions &options) const {
+    const double expected = static_cast<double>(sent_lines) * connected;
+    char buffer[1024];
+    snprintf(buffer, sizeof(buffer),
+             "{\"clients\":%u,\"connected\":%u,\"mode\":\"%s\",\"line_bytes\":%u,\"rate\":%lu,\"burst\":%u,"
+             "\"senders\":%u,\"io\":\"%s\",\"sent_lines\":%lu,\"input_lines_per_s\":%.0f,\"seconds\":%.3f,"
+             "\"lines_per_s\":%.0f,\"mb_per_s\":%.2f,"
+             "\"drop_ratio\":%.6f,\"p50_us\":%lu,\"p99_us\":%lu,\"p999_us\":%lu,\"max_us\":%lu}",
+             clients, connected, is_drop ? "drop" : "lossless", options.line_size, options.rate, options.burst,
+             options.senders, options.is_uring ? "uring" : "epoll", sent_lines,
+             sent_lines / std::max(generate_seconds, 1e-9), seconds, recv_lines / std::max(seconds, 1e-9),
+             recv_bytes / std::max(seconds, 1e-9) / 1e6, (expected > 0) ? 1.0 - recv_lines / expected : 0.0,
+             latency.percentile(0.5), latency.percentile(0.99), latency.percentile(0.999), latency.max);
+    return buffer;
+  }
+};
+
+// `channel -s` as a child process reading the generator from a pipe.
+class ServerProcess {
+ public:
+  ServerProcess(const BenchOptions &options, bool is_drop) {
+    int32_t fds[2];
+    if (pipe(fds) < 0) {
+      throw "Failed to create pipe\n";
+    }
+    pid_ = fork();
+    if (pid_ < 0) {
+      throw "Failed to fork server\n";
+    }
+    if (pid_ == 0) {
+      dup2(fds[0], STDIN_FILENO);
+      const int32_t null_fd = open("/dev/null", O_WRONLY);
+      dup2(null_fd, STDOUT_FILENO);
+      close(fds[0]);
+      close(fds[1]);
+      const std::string port = std::to_string(options.port);
+      const std::string senders = std::to_string(options.senders);
+      std::vector<const char *> argv = {options.channel, "-s", "-q", "-p", port.c_str(), "-j", senders.c_str()};
+      if (!is_drop) {
+        argv.push_back("-d");
+      }
+      if (options.is_uring) {
+        argv.push_back("-U");
+      }
+      argv.push_back(nullptr);
+      execv(options.channel, const_cast<char *const *>(argv.data()));
+      _exit(127);
+    }
+    close(fds[0]);
+    input_ = fds[1];
+  }
+
+  ~ServerProcess() {
+    finish();
+    if (pid_ > 0) {
+      kill(pid_, SIGKILL);
+      waitpid(pid_, nullptr, 0);
+    }
+  }
+
+  int32_t input() const { return input_; }
+
+  // End of input, the server drains its clients and exits.
+  void finish() {
+    if (input_ >= 0) {
+      close(input_);
+      input_ = -1;
+    }
+  }
+
+  void wait() {
+    if (pid_ > 0) {
+      waitpid(pid_, nullptr, 0);
+      pid_ = -1;
+    }
+  }
+
+ private:
+  pid_t pid_{-1};
+  int32_t input_{-1};
+};
+
+// Reads frames off a set of connections and only keeps counts: payload bytes, lines and per frame latency from
+// Message::body.generate_timestamp. The payload itself is never buffered.
+class Reader {
+ public:
+  Reader() : epoll_fd_(epoll_create1(0)), latency_us_("latency_us") {
+    if (epoll_fd_ < 0) {
+      throw "Failed to create epoll\n";
+    }
+  }
+
+  ~Reader() {
+    for (const Connection &connection : connections_) {
+      if (connection.socket >= 0) {
+        close(connection.socket);
+      }
+    }
+    close(epoll_fd_);
+  }
+
+  void add(int32_t socket) {
+    connections_.emplace_back();
+    connections_.back().socket = socket;
+  }
+
+  void run(int64_t deadline_us) {
+    for (size_t i = 0; i < connections_.size(); ++i) {
+      struct epoll_event event;
+      event.events = EPOLLIN;
+      event.data.u64 = i;
+      epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, connections_[i].socket, &event);
+    }
+    size_t open = connections_.size();
+    std::vector<char> buffer(64 * 1024);
+    struct epoll_event events[64];
+    while (open > 0 && Message::timestamp_us() < deadline_us) {
+      const int32_t nfds = epoll_wait(epoll_fd_, events, 64, 100);
+      for (int32_t i = 0; i < nfds; ++i) {
+        Connection &connection = connections_[events[i].data.u64];
+        while (true) {
+          const ssize_t length = recv(connection.socket, buffer.data(), buffer.size(), 0);
+          if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+          }
+          if (length <= 0 || !parse_(&connection, buffer.data(), length)) {
+            epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, connection.socket, nullptr);
+            close(connection.socket);
+            connection.socket = -1;
+            --open;
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  uint64_t lines() const { return lines_; }
+  uint64_t bytes() const { return bytes_; }
+  Hist::Snapshot latency() const { return latency_us_.snapshot(); }
+
+ private:
+  struct Connection {
+    int32_t socket{-1};
+    char header[sizeof(Message) + sizeof(MessageExt)];
+    uint32_t header_size{0};
+    uint64_t payload_left{0};
+  };
+
+  // Returns false on a malformed stream.
+  bool parse_(Connection *connection, const char *data, size_t size) {
+    const char *end = data + size;
+    while (data < end) {
+      if (connection->payload_left > 0) {
+        const size_t length = std::min<uint64_t>(connection->payload_left, end - data);
+        for (const char *line = data; (line = static_cast<const char *>(memchr(line, '\n', data + length - line)));
+             ++line) {
+          ++lines_;
+        }
+        bytes_ += length;
+        connection->payload_left -= length;
+        data += length;
+        continue;
+      }
+
+      const Message *msg = reinterpret_cast<const Message *>(connection->header);
+      const size_t needed = (connection->header_size < sizeof(Message)) ? sizeof(Message) : msg->header.size;
+      if (needed < sizeof(Message) || needed > sizeof(connection->header)) {
+        return false;
+      }
+      const size_t length = std::min<size_t>(needed - connection->header_size, end - data);
+      memcpy(connection->header + connection->header_size, data, length);
+      connection->header_size += length;
+      data += length;
+      // wait for the rest, or for the extension the header announces
+      if (connection->header_size < needed || connection->header_size < msg->header.size) {
+        continue;
+      }
+      latency_us_.add_signed(Message::timestamp_us() - msg->body.generate_timestamp);
+      connection->payload_left = msg->body.length;
+      connection->header_size = 0;
+    }
+    return true;
+  }
+
+ private:
+  int32_t epoll_fd_{-1};
+  std::vector<Connection> connections_;
+  uint64_t lines_{0};
+  uint64_t bytes_{0};
+  Hist latency_us_;
+};
+
+int32_t connect_(uint16_t port) {
+  const int32_t client_socket = socket(AF_INET, SOCK_STREAM, 0);
+  if (client_socket < 0) {
+    return -1;
+  }
+  struct sockaddr_in server_address;
+  server_address.sin_family = AF_INET;
+  server_address.sin_port = htons(port);
+  server_address.sin_addr.s_addr = inet_addr("127.0.0.1");
+  if (connect(client_socket, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) {
+    close(client_socket);
+    return -1;
+  }
+  fcntl(client_socket, F_SETFL, fcntl(client_socket, F_GETFL) | O_NONBLOCK);
+  return client_socket;
+}
+
+// Write lines for the configured duration, returns how many.
+uint64_t generate(const BenchOptions &options, int32_t fd) {
+  std::string line(options.line_size - 1, 'x');
+  line += '\n';
+  const std::string chunk = [&]() {
+    std::string result;
+    for (uint32_t i = 0; i < options.burst; ++i) {
+      result += line;
+    }
+    return result;
+  }();
+
+  const auto start = std::chrono::steady_clock::now();
+  const auto stop = start + std::chrono::milliseconds(options.duration_ms);
+  auto next = start;
+  uint64_t lines = 0;
+  while (std::chrono::steady_clock::now() < stop) {
+    if (!write_all(fd, chunk.data(), chunk.size())) {
+      break;
+    }
+    lines += options.burst;
+    if (options.rate > 0) {
+      next += std::chrono::nanoseconds(options.burst * 1000000000ull / options.rate);
+      std::this_thread::sleep_until(next);
+    }
+  }
+  return lines;
+}
+
+BenchResult run(const BenchOptions &options, uint32_t clients, bool is_drop) {
+  BenchResult result;
+  result.clients = clients;
+  result.is_drop = is_drop;
+
+  ServerProcess server(options, is_drop);
+  int32_t probe = -1;
+  for (int32_t i = 0; i < 100 && (probe = connect_(options.port)) < 0; ++i) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  }
+  if (probe < 0) {
+    throw "Failed to reach the server\n";
+  }
+  close(probe);
+
+  const uint32_t thread_count =
+      std::min(clients, (options.threads > 0) ? options.threads : std::max(1u, std::thread::hardware_concurrency()));
+  std::vector<std::unique_ptr<Reader>> readers;
+  for (uint32_t i = 0; i < thread_count; ++i) {
+    readers.push_back(std::make_unique<Reader>());
+  }
+  for (uint32_t i = 0; i < clients; ++i) {
+    const int32_t client_socket = connect_(options.port);
+    if (client_socket >= 0) {
+      readers[i % thread_count]->add(client_socket);
+      ++result.connected;
+    }
+  }
+  // past the server's hello timeout, so every client is served from the first line on
+  std::this_thread::sleep_for(std::chrono::milliseconds(kHelloTimeoutMs * 3));
+
+  const int64_t deadline_us = Message::timestamp_us() + (options.duration_ms + 30 * 1000) * 1000;
+  std::vector<std::thread> threads;
+  for (auto &reader : readers) {
+    threads.emplace_back([&reader, deadline_us]() { reader->run(deadline_us); });
+  }
+
+  const auto start = std::chrono::steady_clock::now();
+  result.sent_lines = generate(options, server.input());
+  result.generate_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  server.finish();
+  for (std::thread &thread : threads) {
+    thread.join();
+  }
+  result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  server.wait();
+
+  for (const auto &reader : readers) {
+    result.recv_lines += reader->lines();
+    result.recv_bytes += reader->bytes();
+    result.latency.merge(reader->latency());
+  }
+  return result;
+}
+
+std::vector<uint32_t> parse_list(const char *text) {
+  std::vector<uint32_t> result;
+  const std::string list(text);
+  for (size_t start = 0; start <= list.size();) {
+    const size_t comma = list.find(',', start);
+    result.push_back(std::stoul(list.substr(start, comma - start)));
+    if (comma == std::string::npos) {
+      break;
+    }
+    start = comma + 1;
+  }
+  return result;
+}
+
+BenchOptions get_options(int32_t argc, char *const argv[]) {
+  BenchOptions options;
+  const char *opts = "hUc:p:n:m:s:r:B:t:T:j:";
+  const char *help = "Usage: channel_bench [options]\n"
+                     "Options:\n"
+                     "  -h\t\tShow this help message\n"
+                     "  -c\t\tPath of the channel binary\n"
+                     "  -p\t\tPort for the server\n"
+                     "  -n\t\tComma separated client counts\n"
+                     "  -m\t\tServer modes: drop, lossless or both\n"
+                     "  -s\t\tLine size in bytes including the newline\n"
+                     "  -r\t\tLines per second, 0 for as fast as possible\n"
+                     "  -B\t\tLines per burst\n"
+                     "  -t\t\tMilliseconds of input per scenario\n"
+                     "  -T\t\tClient reader threads, 0 for one per core\n"
+                     "  -j\t\tServer sender threads\n"
+                     "  -U\t\tRun the server with io_uring\n";
+  for (int32_t opt_value = getopt(argc, argv, opts); opt_value != -1; opt_value = getopt(argc, argv, opts)) {
+    switch (opt_value) {
+    case 'c':
+      options.channel = optarg;
+      break;
+    case 'p':
+      options.port = std::stoi(optarg);
+      break;
+    case 'n':
+      options.clients = parse_list(optarg);
+      break;
+    case 'm':
+      options.drop_modes.clear();
+      if (strcmp(optarg, "lossless") != 0) {
+        options.drop_modes.push_back(true);
+      }
+      if (strcmp(optarg, "drop") != 0) {
+        options.drop_modes.push_back(false);
+      }
+      break;
+    case 's':
+      options.line_size = std::max(1, std::stoi(optarg));
+      break;
+    case 'r':
+      options.rate = std::stoull(optarg);
+      break;
+    case 'B':
+      options.burst = std::max(1, std::stoi(optarg));
+      break;
+    case 't':
+      options.duration_ms = std::stoll(optarg);
+      break;
+    case 'T':
+      options.threads = std::stoul(optarg);
+      break;
+    case 'U':
+      options.is_uring = true;
+      break;
+    case 'j':
+      options.senders = std::max(1, std::stoi(optarg));
+      break;
+    default:
+      Log::raw("%s", help);
+      exit(0);
+      break;
+    }
+  }
+  return options;
+}
+
+int32_t main(int32_t argc, char *const argv[]) {
+  const BenchOptions options = get_options(argc, argv);
+  signal(SIGPIPE, SIG_IGN);
+  // a thousand clients need a thousand sockets on both ends
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  try {
+    for (const bool is_drop : options.drop_modes) {
+      for (const uint32_t clients : options.clients) {
+        const BenchResult result = run(options, clients, is_drop);
+        Log::raw("%s\n", result.to_json(options).c_str());
+        fflush(stdout);
+      }
+    }
+  } catch (const char *message) {
+    Log::raw("%s", message);
+    return 1;
+  }
+  return 0;
+}
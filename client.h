@@ -2,23 +2,81 @@
 #define CHANNEL_CLIENT_H
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <chrono>
+#include <functional>
 #include <memory>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include "config.h"
 #include "log.h"
+#include "lz.h"
+#include "shm.h"
+#include "stats.h"
+#include "uring.h"
 #include "utils.h"
 
+struct ClientOptions {
+  std::string ip{kDefaultIP};
+  uint16_t port{kDefaultPort};
+  // ask the server for Lz compressed batches
+  bool is_compress{false};
+  // where to start in the server's history: "latest", "bytes:N" for the last N bytes or "index:I"
+  std::string start{"latest"};
+  // reconnect with backoff when the connection fails and resume after the last frame
+  bool is_reconnect{false};
+  // dump stats as JSON lines to stderr this often, 0 for only on SIGUSR1
+  int64_t stats_interval_ms{0};
+  // server channels to subscribe to, empty for its default one. With several each line is prefixed by its channel
+  std::vector<std::string> channels;
+  // only receive matching lines, see Filter for the spec, empty for everything
+  std::string filter{""};
+  // "group:port" to receive from a multicast group instead, the TCP server is only asked for channel ids and gaps
+  std::string multicast{""};
+  // fetch what the multicast group lost from the server instead of just counting it
+  bool is_fetch{false};
+  // name of the shared memory object of a server on this host to read from instead, the TCP server is not used
+  std::string shm{""};
+  // wait and read in one io_uring call per batch when the kernel has it, epoll otherwise
+  bool is_uring{false};
+  // ask for a CRC-32C of every payload, a mismatch ends the connection like a broken one
+  bool is_checksum{false};
+  // start every line with when the server read it, seconds since the epoch in the server's clock
+  bool is_timestamps{false};
+  // what this server is called among several a Merge reads, its stats carry it
+  std::string source{""};
+};
+
+// A record as a relay gets it, the payload inflated and the timestamps as the upstream server sent them. Without a
+// record index from the server it is a whole frame.
+struct RelayFrame {
+  // channel name, empty for the default channel of a connection that named none
+  const std::string *channel{nullptr};
+  const char *data{nullptr};
+  size_t size{0};
+  int64_t generate_timestamp{0};
+  uint32_t hops{0};
+};
+
 class Client {
  public:
-  Client(const char *ip, uint16_t port) {
-    ip_ = ip;
-    port_ = port;
+  Client(const ClientOptions &options) : options_(options), stats_("client", options.stats_interval_ms) {
+    ip_ = options_.ip;
+    port_ = options_.port;
+    // frames without a channel id belong to the default channel
+    streams_[0] = Stream();
     client_socket_ = socket(AF_INET, SOCK_STREAM, 0);
     close(client_socket_);
 
@@ -26,6 +84,36 @@ class Client {
     if (client_socket_ < 0) {
       throw "Failed to create client socket\n";
     }
+    if (options_.is_uring) {
+      uring_ = Uring::create(kUringEntries);
+      if (!uring_) {
+        Log::info("io_uring is not available, using epoll");
+      }
+    }
+
+    if (!options_.source.empty()) {
+      stats_.tag("source", options_.source);
+    }
+    stats_.add("recv_bytes", &recv_bytes_);
+    stats_.add("wire_bytes", &wire_bytes_);
+    stats_.add("frames", &frames_);
+    stats_.add("reconnects", &reconnects_);
+    stats_.add("gap_bytes", &gap_bytes_);
+    stats_.add("disconnected_us", &disconnected_us_);
+    stats_.add("invalid_timestamps", &invalid_timestamps_);
+    stats_.add("clock_offset_us", &clock_offset_us_);
+    stats_.add("rtt_us", &rtt_us_);
+    if (!options_.multicast.empty()) {
+      stats_.add("gap_records", &gap_records_);
+      stats_.add("fetch_bytes", &fetch_bytes_);
+    } else if (!options_.shm.empty()) {
+      stats_.add("gap_records", &gap_records_);
+    }
+    stats_.add(&send_delay_us_hist_);
+    stats_.add(&generate_delay_us_hist_);
+    stats_.add(&hop_delay_us_hist_);
+    stats_.add(&rtt_us_hist_);
+    stats_.start();
   }
 
   ~Client() {
@@ -35,20 +123,400 @@ class Client {
   }
 
   void recv_message() {
+    Writer writer(STDOUT_FILENO);
+    if (!options_.multicast.empty()) {
+      receive_multicast_(&writer);
+      return;
+    }
+    if (!options_.shm.empty()) {
+      receive_shm_(&writer);
+      return;
+    }
+    int64_t backoff_ms = kReconnectMinDelayMs;
+    int64_t disconnected_us = 0;
+    while (true) {
+      if (!connect_()) {
+        if (!options_.is_reconnect) {
+          throw "Failed to connect to server\n";
+        }
+        Log::debug("Failed to connect to server, retry in %ld ms", backoff_ms);
+        std::this_thread::sleep_for(std::chrono::milliseconds(backoff_ms));
+        backoff_ms = std::min(backoff_ms * 2, kReconnectMaxDelayMs);
+        continue;
+      }
+      if (disconnected_us > 0) {
+        const int64_t disconnected_for_us = Message::steady_us() - disconnected_us;
+        ++reconnects_;
+        disconnected_us_ += disconnected_for_us;
+        Log::info("Reconnected after %ld ms, reconnects: %lu", disconnected_for_us / 1000, reconnects_.load());
+      }
+      backoff_ms = kReconnectMinDelayMs;
+
+      const bool is_output_ok = receive_(&writer);
+      close(client_socket_);
+      client_socket_ = -1;
+      if (!is_output_ok || !options_.is_reconnect) {
+        break;
+      }
+      disconnected_us = Message::steady_us();
+    }
+    writer.flush();
+    Log::debug("Received %lu bytes on the wire for %lu bytes", wire_bytes_.load(), recv_bytes_.load());
+    if (options_.is_reconnect) {
+      Log::info("Reconnects: %lu, gap: %lu bytes, disconnected: %lu ms", reconnects_.load(), gap_bytes_.load(),
+                disconnected_us_.load() / 1000);
+    }
+  }
+
+  // Like recv_message(), but every record goes to `handler` instead of stdout. It is only valid during the call,
+  // returning false ends the connection for good.
+  void relay(const std::function<bool(const RelayFrame &)> &handler) {
+    handler_ = handler;
+    recv_message();
+  }
+
+ private:
+  // drives the connection from a loop of its own, a record at a time through handler_
+  friend class Merge;
+
+  // What was received from one server channel.
+  struct Stream {
+    // empty for the default channel of an old style connection
+    std::string name{""};
+    std::string prefix{""};
+    // send_bytes of the last frame handed out, where a reconnect resumes
+    uint64_t last_send_bytes{0};
+    // what the current connection delivered, send_bytes has to stay ahead of it
+    uint64_t recv_bytes{0};
+    bool is_line_start{true};
+    // multicast: body.index the next frame has to start at, once the first one arrived
+    uint32_t next_index{0};
+    bool is_synced{false};
+    // multicast: the pieces of the record at next_index so far
+    std::string fragments{""};
+  };
+
+  bool connect_() {
+    if (client_socket_ < 0) {
+      client_socket_ = socket(AF_INET, SOCK_STREAM, 0);
+      if (client_socket_ < 0) {
+        throw "Failed to create client socket\n";
+      }
+    }
+
+    if (!connect_to_(client_socket_) || !write_hello_(client_socket_, hello_options_())) {
+      close(client_socket_);
+      client_socket_ = -1;
+      return false;
+    }
+    return true;
+  }
+
+  bool connect_to_(int32_t fd) const {
     struct sockaddr_in server_address;
     server_address.sin_family = AF_INET;
     server_address.sin_port = htons(port_);
-    server_address.sin_addr.s_addr = inet_addr(ip_);
+    server_address.sin_addr.s_addr = inet_addr(ip_.c_str());
+    return connect(fd, (struct sockaddr *)&server_address, sizeof(server_address)) == 0;
+  }
+
+  // One short request over its own TCP connection, `options` as in a hello. Every data frame goes to `on_frame`,
+  // the subscription answer is returned. Ends when the server closes the connection or stays silent too long.
+  std::string request_(const std::string &options,
+                       const std::function<void(const Frame *, const char *)> &on_frame) const {
+    std::string answer = "";
+    const int32_t fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      return answer;
+    }
+    struct timeval timeout = {kFetchTimeoutMs / 1000, (kFetchTimeoutMs % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (connect_to_(fd) && write_hello_(fd, options)) {
+      Receiver receiver(kRecvBufferSize);
+      while (receiver.fill(fd) > 0) {
+        const char *payload = nullptr;
+        for (const Frame *frame = receiver.next(&payload); frame != nullptr; frame = receiver.next(&payload)) {
+          if (frame->flags & kFlagHello) {
+            answer.append(payload, frame->length);
+          } else {
+            on_frame(frame, payload);
+          }
+        }
+        if (receiver.is_corrupt()) {
+          break;
+        }
+        receiver.compact();
+      }
+    }
+    close(fd);
+    return answer;
+  }
+
+  // Receive from the multicast group until the output fails. Frames of a channel have to follow each other without
+  // a gap in body.index, what is missing is fetched over TCP or counted as lost.
+  void receive_multicast_(Writer *writer) {
+    const size_t colon = options_.multicast.find(':');
+    struct ip_mreq membership = {};
+    if (colon == std::string::npos ||
+        inet_pton(AF_INET, options_.multicast.substr(0, colon).c_str(), &membership.imr_multiaddr) != 1) {
+      throw "Invalid multicast group\n";
+    }
+    const int32_t fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      throw "Failed to create multicast socket\n";
+    }
+    int32_t opt = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    opt = kMulticastRecvBuffer;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &opt, sizeof(opt));
+    struct sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(std::stoi(options_.multicast.substr(colon + 1)));
+    address.sin_addr = membership.imr_multiaddr;
+    membership.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership)) < 0) {
+      close(fd);
+      throw "Failed to join multicast group\n";
+    }
+
+    // channel ids only come with a subscription answer, ask for one without any data
+    if (!options_.channels.empty()) {
+      std::string options = "channels=";
+      for (size_t i = 0; i < options_.channels.size(); ++i) {
+        options += ((i > 0) ? "," : "") + options_.channels[i];
+      }
+      const std::string answer = request_(options + "\ncount=0\n", [](const Frame *, const char *) {});
+      if (answer.empty()) {
+        close(fd);
+        throw "Failed to subscribe to channels\n";
+      }
+      subscribed_(parse_options(answer.data(), answer.size()));
+    }
+
+    std::unique_ptr<char[]> buffer = std::make_unique<char[]>(kMaxDatagramSize);
+    while (true) {
+      const ssize_t length = recv(fd, buffer.get(), kMaxDatagramSize, 0);
+      if (length < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        Log::error("Failed to receive from multicast group");
+        break;
+      }
+      Frame frame;
+      const int32_t header_size = decode_frame(buffer.get(), length, &frame);
+      if (header_size <= 0 || frame.fields < kFieldsRange ||
+          static_cast<size_t>(length) != header_size + static_cast<size_t>(frame.length)) {
+        Log::debug("Skip invalid datagram of %ld bytes", length);
+        continue;
+      }
+      auto it = streams_.find(frame.channel);
+      if (it == streams_.end()) {
+        continue;
+      }
+      // from here on a piece stands for its whole record
+      const uint32_t piece = frame.length;
+      if (frame.flags & kFlagFragment) {
+        frame.length = frame.raw_length;
+      }
+      Stream *stream = &it->second;
+      if (!stream->is_synced) {
+        stream->is_synced = true;
+        stream->next_index = frame.index;
+      }
+      const int32_t ahead = static_cast<int32_t>(frame.index - stream->next_index);
+      if (ahead < 0) {
+        // late, its records were fetched or counted as lost already
+        continue;
+      }
+      if (ahead > 0) {
+        gap_(writer, stream, &frame);
+      }
+      // a heartbeat only tells where the channel is
+      if (frame.records == 0) {
+        continue;
+      }
+      const char *payload = buffer.get() + header_size;
+      if (frame.flags & kFlagFragment) {
+        // a piece lost on the way leaves the record short, the next record's datagram reports it as a gap
+        if (ahead > 0 || stream->fragments.size() + piece > frame.raw_length) {
+          stream->fragments.clear();
+        }
+        stream->fragments.append(payload, piece);
+        if (stream->fragments.size() < frame.raw_length) {
+          continue;
+        }
+        payload = stream->fragments.data();
+      }
+      output_(writer, stream, payload, frame.length, frame.generate_timestamp);
+      if (!writer->flush()) {
+        Log::error("Failed to write output");
+        break;
+      }
+      const IndexEntry whole = {frame.length, frame.generate_timestamp};
+      received_(stream, &frame, frame.length, &whole, 1);
+      stream->next_index = frame.index + frame.records;
+      stream->fragments.clear();
+    }
+    close(fd);
+  }
 
-    // clear socker buffer first
-    char buffer[kMaxMessageSize];
-    for (int64_t clear_bytes = read(client_socket_, buffer, sizeof(buffer)); clear_bytes > 0;) {
-      Log::debug("Clear socket buffer %ld bytes", clear_bytes);
+  // Read the server's shared memory until it closes or the output fails. Records the server reclaimed before they
+  // were read are counted as lost.
+  void receive_shm_(Writer *writer) {
+    int64_t backoff_ms = kReconnectMinDelayMs;
+    std::unique_ptr<Shm> shm = Shm::open(options_.shm);
+    while (!shm) {
+      if (!options_.is_reconnect) {
+        throw "Failed to open shared memory\n";
+      }
+      Log::debug("Failed to open shared memory, retry in %ld ms", backoff_ms);
+      std::this_thread::sleep_for(std::chrono::milliseconds(backoff_ms));
+      backoff_ms = std::min(backoff_ms * 2, kReconnectMaxDelayMs);
+      shm = Shm::open(options_.shm);
+    }
+
+    // streams are keyed by the channel's index in the object, without channels it is the server's first one
+    std::vector<uint32_t> indexes = {0};
+    if (!options_.channels.empty()) {
+      indexes.clear();
+      streams_.clear();
+    }
+    for (const std::string &name : options_.channels) {
+      const int32_t index = shm->find(name);
+      if (index < 0) {
+        throw "Unknown channel in shared memory\n";
+      }
+      Stream &stream = streams_[index];
+      stream.name = name;
+      stream.prefix = "[" + name + "] ";
+      indexes.push_back(index);
     }
-    if (connect(client_socket_, (struct sockaddr *)&server_address, sizeof(server_address)) < 0) {
-      throw "Failed to connect to server\n";
+    std::vector<uint64_t> cursors;
+    for (const uint32_t index : indexes) {
+      const uint64_t head = shm->head(index);
+      const uint64_t tail = shm->tail(index);
+      uint64_t cursor = (options_.start == "latest") ? head : tail;
+      if (options_.start.rfind("index:", 0) == 0) {
+        cursor = std::clamp<uint64_t>(strtoull(options_.start.c_str() + 6, nullptr, 10), tail, head);
+      } else if (options_.start.rfind("bytes:", 0) == 0) {
+        cursor = shm->rewind(index, strtoull(options_.start.c_str() + 6, nullptr, 10));
+      }
+      cursors.push_back(cursor);
     }
 
+    std::unique_ptr<char[]> buffer = std::make_unique<char[]>(kShmReadBytes);
+    Frame frame;
+    bool is_output_ok = true;
+    while (is_output_ok) {
+      // taken first, a write after it wakes the wait below
+      const uint32_t sequence = shm->sequence();
+      const bool is_closed = shm->is_closed();
+      bool is_read = false;
+      for (size_t i = 0; i < indexes.size() && is_output_ok; ++i) {
+        Stream *stream = &streams_[indexes[i]];
+        uint64_t lost = 0;
+        const size_t size = shm->read(indexes[i], &cursors[i], buffer.get(), kShmReadBytes, &records_, &lost);
+        if (lost > 0) {
+          gap_records_ += lost;
+          Log::debug("Lost %lu records of channel %s", lost, stream->name.c_str());
+        }
+        if (records_.empty()) {
+          continue;
+        }
+        is_read = true;
+        const char *data = buffer.get();
+        for (const IndexEntry &record : records_) {
+          if (handler_) {
+            const RelayFrame relayed = {&stream->name, data, record.length, record.generate_timestamp, 0};
+            is_output_ok = handler_(relayed);
+          } else {
+            output_(writer, stream, data, record.length, record.generate_timestamp);
+          }
+          if (!is_output_ok) {
+            break;
+          }
+          data += record.length;
+        }
+        if (is_output_ok && !writer->flush()) {
+          Log::error("Failed to write output");
+          is_output_ok = false;
+        }
+        // one frame as far as the stats go, the same clock on both sides
+        frame.length = size;
+        frame.records = records_.size();
+        frame.generate_timestamp = records_.back().generate_timestamp;
+        frame.send_bytes = stream->last_send_bytes + size + sizeof(Message) * records_.size();
+        received_(stream, &frame, size, records_.data(), records_.size());
+      }
+      if (!is_read) {
+        if (is_closed) {
+          Log::info("Shared memory closed");
+          break;
+        }
+        shm->wait(sequence, kShmWaitMs);
+      }
+    }
+    writer->flush();
+  }
+
+  // Records [stream->next_index, frame->index) never arrived, `frame` covers frame->records records.
+  void gap_(Writer *writer, Stream *stream, const Frame *frame) {
+    const uint32_t count = frame->index - stream->next_index;
+    if (options_.is_fetch) {
+      std::string options = stream->name.empty() ? "" : "channels=" + stream->name + "\n";
+      options += "range=1\nstart=index:" + std::to_string(stream->next_index) + "\ncount=" + std::to_string(count) +
+                 "\n";
+      request_(options, [&](const Frame *fetched, const char *payload) {
+        if (fetched->fields < kFieldsRange) {
+          return;
+        }
+        // the server no longer had the start of the range
+        gap_records_ += static_cast<uint32_t>(fetched->index - stream->next_index);
+        output_(writer, stream, payload, fetched->length, fetched->generate_timestamp);
+        writer->flush();
+        fetch_bytes_ += fetched->length;
+        const IndexEntry whole = {fetched->length, fetched->generate_timestamp};
+        received_(stream, fetched, fetched->length, &whole, 1);
+        stream->next_index = fetched->index + fetched->records;
+      });
+    }
+    // what the fetch did not bring back is lost, counted up to where this frame starts in the send_bytes stream
+    const uint64_t start = frame->send_bytes - frame->length - sizeof(Message) * frame->records;
+    const uint32_t missing = frame->index - stream->next_index;
+    if (missing > 0) {
+      gap_records_ += missing;
+      gap_bytes_ += (start > stream->last_send_bytes) ? start - stream->last_send_bytes : 0;
+      Log::debug("Lost %u records of channel %s", missing, stream->name.c_str());
+    }
+    Log::debug("Gap of %u records, %u fetched", count, count - missing);
+    stream->next_index = frame->index;
+    stream->last_send_bytes = std::max(stream->last_send_bytes, start);
+  }
+
+  // Account for a frame handed to the output, `records` as its index has them. The generate delay is taken per record.
+  void received_(Stream *stream, const Frame *frame, size_t length, const IndexEntry *records, size_t count) {
+    // count what the stream would take as plain Messages, that is what send_bytes measures
+    stream->recv_bytes += (length + sizeof(Message));
+    recv_bytes_.fetch_add(length + sizeof(Message), std::memory_order_relaxed);
+    wire_bytes_.fetch_add(frame_header_size(frame->version, frame->fields) + frame->length, std::memory_order_relaxed);
+    frames_.fetch_add(1, std::memory_order_relaxed);
+    stream->last_send_bytes = frame->send_bytes;
+
+    // in the server's clock
+    const int64_t recv_timestamp = Message::timestamp_us() + clock_offset_us_;
+    send_delay_us_hist_.add_signed(recv_timestamp - (frame->generate_timestamp + frame->send_timestamp));
+    for (size_t i = 0; i < count; ++i) {
+      generate_delay_us_hist_.add_signed(recv_timestamp - records[i].generate_timestamp);
+    }
+    if (frame->hops > 0) {
+      hop_delay_us_hist_.add_signed(recv_timestamp - frame->relay_timestamp);
+    }
+  }
+
+  // Receive one connection until it fails. Returns false if the output failed, there is no point in reconnecting.
+  bool receive_(Writer *writer) {
     const int32_t epoll_fd = epoll_create1(0);
     if (epoll_fd < 0) {
       throw "Failed to create epoll\n";
@@ -61,109 +529,414 @@ class Client {
       throw "Failed to add client socket to epoll\n";
     }
 
-    auto print_message = [](const Message *msg) {
-      Log::error("Message Info:");
-      Log::error("  Version: %u", msg->header.version);
-      Log::error("  Size: %u", msg->header.size);
-      Log::error("  Index: %lu", msg->body.index);
-      Log::error("  Generate Timestamp: %ld", msg->body.generate_timestamp);
-      Log::error("  Send Timestamp: %ld", msg->body.send_timestamp);
-      Log::error("  Send Bytes: %lu", msg->body.send_bytes);
-      Log::error("  Length: %lu", msg->body.length);
-    };
-
-    Hist<uint64_t> send_delay_us_hist("send delay", {50, 100, 500, 1000});
-    Hist<uint64_t> generate_delay_us_hist("generate delay", {50, 100, 500, 1000, 10000});
-    const int64_t message_size = static_cast<int64_t>(sizeof(Message));
-    uint64_t prev_length = message_size + kMaxMessageSize + 1;
-    std::unique_ptr<char[]> message = std::make_unique<char[]>(prev_length);
+    Receiver receiver(kRecvBufferSize);
+    // with io_uring the wait and the read are one call, into a buffer the kernel has mapped already
+    const bool is_uring = uring_ && uring_->register_buffer(receiver.data(), receiver.capacity());
+    bool is_reading = false;
+    // inflated payloads, kept until the writer flushed them
+    std::unique_ptr<char[]> inflated = std::make_unique<char[]>(kRecvBufferSize);
+    // what this connection delivered, send_bytes has to stay ahead of it
+    for (auto &[id, stream] : streams_) {
+      stream.recv_bytes = 0;
+    }
     struct epoll_event events[1];
-    while (true) {
-      if (epoll_wait(epoll_fd, events, 1, -1) < 0) {
-        Log::error("Failed to wait for epoll");
-        break;
+    bool is_running = true;
+    bool is_output_ok = true;
+    int64_t next_ping_us = 0;
+    while (is_running) {
+      const int64_t now_us = Message::steady_us();
+      if (now_us >= next_ping_us) {
+        ping_();
+        next_ping_us = now_us + kPingIntervalMs * 1000;
+      }
+      ssize_t read_bytes = 0;
+      if (is_uring) {
+        if (!is_reading) {
+          is_reading = uring_->read_fixed(client_socket_, receiver.space(), receiver.space_size(), 0);
+        }
+        const int32_t result = uring_->submit(1, next_ping_us - now_us);
+        if (result < 0 && result != -ETIME && result != -EINTR) {
+          Log::error("Failed to wait for io_uring: %s", strerror(-result));
+          break;
+        }
+        bool is_done = false;
+        uring_->reap([&](uint64_t, int32_t res, uint32_t) {
+          is_done = true;
+          read_bytes = res;
+        });
+        if (!is_done) {
+          continue;
+        }
+        is_reading = false;
+        if (read_bytes > 0) {
+          receiver.commit(read_bytes);
+        } else if (read_bytes < 0) {
+          errno = -read_bytes;
+          read_bytes = -1;
+        }
+      } else {
+        const int32_t nfds = epoll_wait(epoll_fd, events, 1, (next_ping_us - now_us + 999) / 1000);
+        if (nfds < 0) {
+          if (errno == EINTR) {
+            continue;
+          }
+          Log::error("Failed to wait for epoll");
+          break;
+        }
+        if (nfds == 0) {
+          continue;
+        }
+        read_bytes = receiver.fill(client_socket_);
       }
-
-      int64_t read_bytes = read(client_socket_, message.get(), message_size);
       if (read_bytes <= 0) {
+        if (read_bytes < 0 && (errno == EINTR || errno == EAGAIN)) {
+          continue;
+        }
         Log::error("Connection closed");
         break;
       }
-      if (read_bytes < message_size) {
-        Log::error("Failed to read message");
-        break;
-      }
-      const Message *msg = reinterpret_cast<Message *>(message.get());
-      if (msg->header.version != kVersion.version || msg->header.size != message_size) {
-        Log::error("Invalid message version or size, version: %u vs %u, size: %u vs %lu", msg->header.version,
-                   kVersion.version, msg->header.size, message_size);
-        print_message(msg);
+
+      is_running = deliver_(&receiver, writer, inflated.get(), &is_output_ok);
+      // payloads point into the receive buffer, hand them out before it is compacted
+      if (!writer->flush()) {
+        Log::error("Failed to write output");
+        is_output_ok = false;
         break;
       }
+      receiver.compact();
+    }
+    if (is_reading) {
+      // the read holds on to the socket and the buffer, end it before either goes away
+      shutdown(client_socket_, SHUT_RDWR);
+      uring_->submit(1);
+      uring_->reap([](uint64_t, int32_t, uint32_t) {});
+    }
+    writer->flush();
+    close(epoll_fd);
+    return is_output_ok;
+  }
 
-      Log::debug("Message Info:");
-      Log::debug("  Version: %u", msg->header.version);
-      Log::debug("  Size: %u", msg->header.size);
-      Log::debug("  Index: %lu", msg->body.index);
-      Log::debug("  Generate Timestamp: %ld", msg->body.generate_timestamp);
-      Log::debug("  Send Timestamp: %ld", msg->body.send_timestamp);
-      Log::debug("  Send Bytes: %lu", msg->body.send_bytes);
-      Log::debug("  Length: %lu", msg->body.length);
-      const uint64_t current_length = message_size + msg->body.length + 1;
-      if (current_length > prev_length) {
-        std::unique_ptr<char[]> new_message = std::make_unique<char[]>(current_length);
-        if (new_message == nullptr) {
-          Log::error("Failed to allocate message buffer");
-          print_message(msg);
-          break;
+  // Hand out the complete frames in `receiver`, compressed payloads are inflated into `inflated`, kRecvBufferSize
+  // bytes that have to stay put until the writer flushed. Returns false when the connection has to end, with
+  // `is_output_ok` cleared if the output failed.
+  bool deliver_(Receiver *receiver, Writer *writer, char *inflated, bool *is_output_ok) {
+    size_t inflated_size = 0;
+    const char *payload = nullptr;
+    for (const Frame *frame = receiver->next(&payload); frame != nullptr; frame = receiver->next(&payload)) {
+      if (frame->flags & kFlagPong) {
+        pong_(frame, parse_options(payload, frame->length));
+        continue;
+      }
+      if (frame->flags & kFlagHello) {
+        if (frame->length > 0) {
+          subscribed_(parse_options(payload, frame->length));
+        } else {
+          resumed_(frame->channel, frame->send_bytes);
         }
-        memcpy(new_message.get(), msg, message_size);
-        message = std::move(new_message);
-        msg = reinterpret_cast<Message *>(message.get());
-        Log::debug("Reallocate message buffer from %lu to %lu", prev_length, current_length);
-        prev_length = current_length;
+        continue;
       }
-      read_bytes = read(client_socket_, message.get() + message_size, msg->body.length);
-      if (read_bytes < static_cast<int64_t>(msg->body.length)) {
-        Log::error("Failed to read message body, length: %lu", msg->body.length);
-        print_message(msg);
-        break;
+      auto it = streams_.find(frame->channel);
+      if (it == streams_.end()) {
+        Log::error("Message of unknown channel %u", frame->channel);
+        return false;
+      }
+      Stream *stream = &it->second;
+      if (!check_message_(frame, stream->recv_bytes)) {
+        return false;
+      }
+      size_t length = frame->length;
+      records_.clear();
+      if (frame->flags & kFlagIndex) {
+        const int32_t index_size = decode_index(payload, length, frame->generate_timestamp, &records_);
+        if (index_size < 0) {
+          Log::error("Invalid record index");
+          print_message_(frame);
+          return false;
+        }
+        payload += index_size;
+        length -= index_size;
+      }
+      if (frame->flags & kFlagCompressed) {
+        if (inflated_size + frame->raw_length > kRecvBufferSize) {
+          writer->flush();
+          inflated_size = 0;
+        }
+        char *raw = inflated + inflated_size;
+        if (frame->raw_length > kRecvBufferSize || !Lz::decompress(payload, length, raw, frame->raw_length)) {
+          Log::error("Failed to decompress message, length: %lu, raw length: %u", length, frame->raw_length);
+          print_message_(frame);
+          return false;
+        }
+        inflated_size += frame->raw_length;
+        payload = raw;
+        length = frame->raw_length;
+      }
+      // without an index the frame is one record as far as this side can tell
+      if (records_.empty()) {
+        records_.push_back({static_cast<uint32_t>(length), frame->generate_timestamp});
+      }
+      size_t indexed = 0;
+      for (const IndexEntry &record : records_) {
+        indexed += record.length;
+      }
+      if (indexed != length) {
+        Log::error("Record index covers %lu bytes of %lu", indexed, length);
+        print_message_(frame);
+        return false;
       }
-      const int64_t recv_timestamp = Message::timestamp_us();
-      message[current_length - 1] = 0;
+      const char *record_data = payload;
+      for (const IndexEntry &record : records_) {
+        if (handler_) {
+          // passed on in this host's clock
+          const RelayFrame relayed = {&stream->name, record_data, record.length,
+                                      record.generate_timestamp - clock_offset_us_, frame->hops};
+          if (!handler_(relayed)) {
+            *is_output_ok = false;
+            return false;
+          }
+        } else {
+          output_(writer, stream, record_data, record.length, record.generate_timestamp);
+        }
+        record_data += record.length;
+      }
+      received_(stream, frame, length, records_.data(), records_.size());
+      Log::debug("Received %lu bytes, Send %lu bytes, Index %u", recv_bytes_.load(), frame->send_bytes,
+                 frame->index);
+    }
+    return !receiver->is_corrupt();
+  }
 
-      if (msg->body.send_bytes <= recv_bytes_) {
-        Log::error("Invalid send bytes, %lu vs %lu", msg->body.send_bytes, recv_bytes_);
-        print_message(msg);
-        break;
+  // Probe the server's clock, it answers with a pong.
+  void ping_() {
+    ping_timestamp_ = Message::timestamp_us();
+    ping_steady_us_ = Message::steady_us();
+    // v1 like everything a client sends, any server reads it
+    Frame ping;
+    ping.fields = kFieldsChannel;
+    ping.flags = kFlagPing;
+    ping.generate_timestamp = ping_timestamp_;
+    char header[kMaxFrameHeaderSize];
+    write_all(client_socket_, header, encode_frame(ping, header));
+  }
+
+  // NTP's four timestamps: t1 and t4 are read here, t2 and t3 on the server. Only t1 and t2 come from the wall
+  // clocks, t4 - t1 and the server's hold t3 - t2 are monotonic intervals.
+  //   offset = ((t2 - t1) + (t3 - t4)) / 2, round trip = (t4 - t1) - (t3 - t2)
+  // The sample with the lowest round trip of the last kClockSamples is the least distorted by queueing.
+  void pong_(const Frame *frame, const std::unordered_map<std::string, std::string> &options) {
+    const auto receive = options.find("receive");
+    const auto hold = options.find("hold");
+    if (frame->generate_timestamp != ping_timestamp_ || receive == options.end() || hold == options.end()) {
+      return;
+    }
+    const int64_t elapsed_us = Message::steady_us() - ping_steady_us_;
+    const int64_t hold_us = std::stoll(hold->second);
+    ClockSample &sample = clock_samples_[clock_sample_count_++ % kClockSamples];
+    sample.rtt_us = std::max<int64_t>(0, elapsed_us - hold_us);
+    sample.offset_us = std::stoll(receive->second) - ping_timestamp_ + (hold_us - elapsed_us) / 2;
+    rtt_us_hist_.add_signed(sample.rtt_us);
+
+    const ClockSample *best = &clock_samples_[0];
+    for (uint32_t i = 1; i < std::min(clock_sample_count_, kClockSamples); ++i) {
+      if (clock_samples_[i].rtt_us < best->rtt_us) {
+        best = &clock_samples_[i];
       }
-      if (msg->body.generate_timestamp > recv_timestamp || msg->body.send_timestamp < 0) {
-        Log::error("Invalid timestamp, generate: %lu, send: %lu, recv: %lu", msg->body.generate_timestamp,
-                   msg->body.send_timestamp, recv_timestamp);
-        print_message(msg);
-        break;
+    }
+    clock_offset_us_ = best->offset_us;
+    rtt_us_ = best->rtt_us;
+    Log::debug("Clock offset %ld us, round trip %ld us", best->offset_us, best->rtt_us);
+  }
+
+  // The server tells where a resumed stream continues, anything between there and the last frame is lost.
+  void resumed_(uint32_t channel, uint64_t position) {
+    auto it = streams_.find(channel);
+    if (it == streams_.end()) {
+      return;
+    }
+    Stream &stream = it->second;
+    if (position > stream.last_send_bytes) {
+      gap_bytes_ += position - stream.last_send_bytes;
+      Log::info("Resumed with a gap of %lu bytes", position - stream.last_send_bytes);
+    } else if (position < stream.last_send_bytes) {
+      Log::info("Server stream started over at %lu bytes, was at %lu", position, stream.last_send_bytes);
+    }
+    stream.last_send_bytes = position;
+  }
+
+  // The server answered the subscription with "<id>=<name>" lines. Ids may differ after a server restart, what was
+  // received so far stays with the name.
+  void subscribed_(const std::unordered_map<std::string, std::string> &channels) {
+    std::unordered_map<uint32_t, Stream> streams;
+    for (const auto &[id, name] : channels) {
+      Stream &stream = streams[std::stoul(id)];
+      stream.name = name;
+      stream.prefix = "[" + name + "] ";
+      for (const auto &[old_id, old_stream] : streams_) {
+        if (old_stream.name == name) {
+          stream.last_send_bytes = old_stream.last_send_bytes;
+        }
       }
+    }
+    streams_ = std::move(streams);
+  }
 
-      Log::raw("%s", message.get() + message_size);
-      recv_bytes_ += (msg->body.length + message_size);
+  // Hand a payload to the writer, with several channels every line starts with its channel's name and with
+  // timestamps with `generate_timestamp`, when the server read it.
+  void output_(Writer *writer, Stream *stream, const char *data, size_t size, int64_t generate_timestamp) {
+    const bool is_prefixed = options_.channels.size() > 1;
+    if (!is_prefixed && !options_.is_timestamps) {
+      writer->add(data, size);
+      return;
+    }
+    char timestamp[32];
+    const int32_t timestamp_size =
+        options_.is_timestamps
+            ? snprintf(timestamp, sizeof(timestamp), "%ld.%06ld ", generate_timestamp / 1000000,
+                       generate_timestamp % 1000000)
+            : 0;
+    const char *const end = data + size;
+    while (data < end) {
+      const char *line_end = static_cast<const char *>(memchr(data, '\n', end - data));
+      line_end = (line_end != nullptr) ? line_end + 1 : end;
+      if (stream->is_line_start) {
+        writer->copy(timestamp, timestamp_size);
+        if (is_prefixed) {
+          writer->add(stream->prefix.data(), stream->prefix.size());
+        }
+      }
+      writer->add(data, line_end - data);
+      stream->is_line_start = (line_end[-1] == '\n');
+      data = line_end;
+    }
+  }
 
-      send_delay_us_hist.add(recv_timestamp - (msg->body.generate_timestamp + msg->body.send_timestamp));
-      generate_delay_us_hist.add(recv_timestamp - msg->body.generate_timestamp);
-      Log::debug("Received %lu bytes, Send %lu bytes, Index %lu", recv_bytes_, msg->body.send_bytes, msg->body.index);
-      generate_delay_us_hist.print();
-      send_delay_us_hist.print();
+  // What this client understands and where to start, old servers never read it.
+  std::string hello_options_() const {
+    // v2 frames take batches past 64 KiB and index their records, old servers keep sending v1
+    std::string options = "hops=1\nwire=2\nindex=1\n";
+    if (options_.is_checksum) {
+      options += "checksum=1\n";
+    }
+    if (options_.is_compress) {
+      options += "compress=lz\n";
+    }
+    if (!options_.filter.empty()) {
+      options += "filter=" + options_.filter + "\n";
+    }
+    if (!options_.channels.empty()) {
+      options += "channels=";
+      for (size_t i = 0; i < options_.channels.size(); ++i) {
+        options += ((i > 0) ? "," : "") + options_.channels[i];
+      }
+      options += "\n";
+    }
+    // after a reconnect pick up right behind the last frame of each channel
+    const auto it = streams_.find(0);
+    if (options_.channels.empty() && it != streams_.end() && it->second.last_send_bytes > 0) {
+      options += "start=resume:" + std::to_string(it->second.last_send_bytes) + "\n";
+    } else {
+      options += "start=" + options_.start + "\n";
+      for (const auto &[id, stream] : streams_) {
+        if (!stream.name.empty() && stream.last_send_bytes > 0) {
+          options += "start." + stream.name + "=resume:" + std::to_string(stream.last_send_bytes) + "\n";
+        }
+      }
     }
 
-    close(epoll_fd);
-    close(client_socket_);
-    client_socket_ = -1;
+    return options;
+  }
+
+  static bool write_hello_(int32_t fd, const std::string &options) {
+    Frame hello;
+    hello.fields = kFieldsChannel;
+    hello.flags = kFlagHello;
+    hello.generate_timestamp = Message::timestamp_us();
+    hello.length = options.size();
+    char header[kMaxFrameHeaderSize];
+    std::string message(header, encode_frame(hello, header));
+    message += options;
+    return write_all(fd, message.data(), message.size());
+  }
+
+  static void print_message_(const Frame *frame) {
+    Log::error("Message Info:");
+    Log::error("  Version: %u", frame->version);
+    Log::error("  Size: %u", frame_header_size(frame->version, frame->fields));
+    Log::error("  Index: %u", frame->index);
+    Log::error("  Generate Timestamp: %ld", frame->generate_timestamp);
+    Log::error("  Send Timestamp: %d", frame->send_timestamp);
+    Log::error("  Send Bytes: %lu", frame->send_bytes);
+    Log::error("  Length: %u", frame->length);
+  }
+
+  bool check_message_(const Frame *frame, uint64_t recv_bytes) {
+    Log::debug("Message Info:");
+    Log::debug("  Version: %u", frame->version);
+    Log::debug("  Size: %u", frame_header_size(frame->version, frame->fields));
+    Log::debug("  Index: %u", frame->index);
+    Log::debug("  Generate Timestamp: %ld", frame->generate_timestamp);
+    Log::debug("  Send Timestamp: %d", frame->send_timestamp);
+    Log::debug("  Send Bytes: %lu", frame->send_bytes);
+    Log::debug("  Length: %u", frame->length);
+
+    if (frame->send_bytes <= recv_bytes) {
+      Log::error("Invalid send bytes, %lu vs %lu", frame->send_bytes, recv_bytes);
+      print_message_(frame);
+      return false;
+    }
+    // clocks that disagree by more than the offset estimate catches are only counted
+    const int64_t recv_timestamp = Message::timestamp_us() + clock_offset_us_.load();
+    if (frame->generate_timestamp > recv_timestamp || frame->send_timestamp < 0) {
+      ++invalid_timestamps_;
+      Log::debug("Invalid timestamp, generate: %ld, send: %d, recv: %ld", frame->generate_timestamp,
+                 frame->send_timestamp, recv_timestamp);
+    }
+    return true;
   }
 
  private:
-  const char *ip_;
+  const ClientOptions options_;
+  std::string ip_;
   uint16_t port_;
   int32_t client_socket_{-1};
-  uint64_t recv_bytes_{0};
+  // one read in flight at a time
+  inline static const uint32_t kUringEntries = 2;
+  std::unique_ptr<Uring> uring_;
+  // by channel id
+  std::unordered_map<uint32_t, Stream> streams_;
+  // records of the frame at hand, from its index
+  std::vector<IndexEntry> records_;
+  std::atomic<uint64_t> recv_bytes_{0};
+  std::atomic<uint64_t> wire_bytes_{0};
+  std::atomic<uint64_t> frames_{0};
+  std::atomic<uint64_t> reconnects_{0};
+  std::atomic<uint64_t> gap_bytes_{0};
+  std::atomic<uint64_t> disconnected_us_{0};
+  std::atomic<uint64_t> invalid_timestamps_{0};
+  // server clock minus this host's, and the round trip of the sample it comes from
+  std::atomic<int64_t> clock_offset_us_{0};
+  std::atomic<int64_t> rtt_us_{0};
+  struct ClockSample {
+    int64_t offset_us{0};
+    int64_t rtt_us{0};
+  };
+  ClockSample clock_samples_[kClockSamples];
+  uint32_t clock_sample_count_{0};
+  int64_t ping_timestamp_{0};
+  int64_t ping_steady_us_{0};
+  // multicast: records that neither arrived nor were fetched, bytes fetched over TCP
+  std::atomic<uint64_t> gap_records_{0};
+  std::atomic<uint64_t> fetch_bytes_{0};
+  // from the server handing the frame to its socket to reading it here
+  Hist send_delay_us_hist_{"send_delay_us"};
+  // from the server reading the line to reading it here
+  Hist generate_delay_us_hist_{"generate_delay_us"};
+  // from the last relay receiving it to reading it here, only for relayed data
+  Hist hop_delay_us_hist_{"hop_delay_us"};
+  Hist rtt_us_hist_{"rtt_us"};
+  std::function<bool(const RelayFrame &)> handler_;
+  // last, so its final dump still sees everything above
+  Stats stats_;
 };
 
 #endif  // CHANNEL_CLIENT_H
\ No newline at end of file
@@ -7,6 +7,56 @@ inline const char *kDefaultIP = "127.0.0.1";
 inline const uint16_t kDefaultPort = 12121;
 inline const uint32_t kMaxClientConnections = 1024;
 inline const uint32_t kMaxMessageSize = 4096;
+// what a server without named channels calls its stdin, and what old clients get
+inline const char *kDefaultChannel = "default";
+inline const uint32_t kMaxChannels = 64;
 inline const uint32_t kMaxMessageQueueSize = 8 * 1024 * 1024 / kMaxMessageSize;
+// already sent data kept on top of the queue for clients that ask for a replay, the sum is a power of two
+inline const uint64_t kMaxHistorySize = 24 * 1024 * 1024;
+inline const uint64_t kDefaultMaxClientLag = 0;
+// segment files lossless mode spills to when slow clients would block the input
+inline const uint64_t kSpillSegmentBytes = 64 * 1024 * 1024;
+inline const uint64_t kSpillSegmentRecords = 1024 * 1024;
+// frames handed to the socket in one sendmsg, see BatchOptions
+inline const uint32_t kMaxBatchFrames = 64;
+inline const uint32_t kDefaultBatchFrames = 16;
+// payload bytes per frame for clients of the v2 wire format, v1 clients get at most kMaxMessageLength
+inline const uint32_t kDefaultBatchBytes = 256 * 1024;
+inline const int64_t kDefaultLingerUs = 0;
+inline const int32_t kMaxSenders = 64;
+// holds the largest frame, kMaxFrameLength plus its header
+inline const uint32_t kRecvBufferSize = 2 * 1024 * 1024;
+// submission queue of a sender's io_uring, a pass queues at most one send per client
+inline const uint32_t kUringEntries = kMaxClientConnections;
+// how long the server waits for a new client's options before treating it as an old client
+inline const int64_t kHelloTimeoutMs = 100;
+inline const uint32_t kMaxHelloSize = 4096;
+// multicast datagrams stay within an Ethernet frame unless a single record is larger
+inline const uint32_t kMulticastPayload = 1400;
+inline const int32_t kMulticastTtl = 1;
+// an idle multicast sender repeats where each channel is this often
+inline const int32_t kMulticastHeartbeatMs = 500;
+// what a multicast client asks for as socket buffer, datagrams it cannot take are gaps
+inline const int32_t kMulticastRecvBuffer = 8 * 1024 * 1024;
+inline const uint32_t kMaxDatagramSize = 64 * 1024;
+// a client waits this long for a range it fetches over TCP
+inline const int64_t kFetchTimeoutMs = 2000;
+// payload each channel keeps in shared memory for clients on the same host, a power of two
+inline const uint64_t kShmChannelBytes = 16 * 1024 * 1024;
+// a shared memory client copies out at most this much of a channel at a time, at least kMaxMessageLength
+inline const uint64_t kShmReadBytes = 256 * 1024;
+// and waits at most this long for a write before it looks again
+inline const int64_t kShmWaitMs = 1000;
+// clients measure the clock offset to the server this often and trust the lowest round trip of the last samples
+inline const int64_t kPingIntervalMs = 1000;
+inline const uint32_t kClockSamples = 8;
+inline const int64_t kReconnectMinDelayMs = 100;
+inline const int64_t kReconnectMaxDelayMs = 10 * 1000;
+// a client merging several servers holds a record this long for older ones from the others
+inline const int64_t kMergeWindowMs = 100;
+// and at most this many bytes altogether, past it the oldest go out before their time
+inline const uint64_t kMergeBufferBytes = 64 * 1024 * 1024;
+// a server that does not take the connection in this time is retried later, the others go on meanwhile
+inline const int64_t kMergeConnectTimeoutMs = 1000;
 
 #endif  // CHANNEL_CONFIG_H
\ No newline at end of file
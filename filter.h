@@ -0,0 +1,283 @@
+#ifndef CHANNEL_FILTER_H
+#define CHANNEL_FILTER_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+#include <queue>
+#include <string>
+#include <vector>
+
+// Line filter a client asks for in its hello, evaluated by the server before anything is sent:
+//   "substr:a|b"  lines containing any of the strings, one Aho-Corasick pass over the whole batch
+//   "regex:re"    lines matching a simple regex of literals, . * + ? ^ $ and \ escapes, in time linear in the line
+//   "level:E|W"   lines starting with one of the prefixes, also right after a leading '['
+// A line is what ends with a newline inside one record, a line split over records is matched piecewise.
+class Filter {
+ public:
+  enum class Kind {
+    kSubstr,
+    kRegex,
+    kLevel,
+  };
+
+  // Returns nullptr for a spec that does not parse.
+  static std::unique_ptr<Filter> compile(const std::string &spec, uint64_t id) {
+    const size_t colon = spec.find(':');
+    if (colon == std::string::npos || colon + 1 == spec.size()) {
+      return nullptr;
+    }
+    const std::string kind = spec.substr(0, colon);
+    const std::string body = spec.substr(colon + 1);
+    std::unique_ptr<Filter> filter(new Filter(spec, id));
+    if (kind == "substr") {
+      filter->kind_ = Kind::kSubstr;
+      filter->patterns_ = split_(body);
+      filter->build_automaton_();
+    } else if (kind == "regex") {
+      filter->kind_ = Kind::kRegex;
+      filter->patterns_.push_back(body);
+      filter->compile_regex_(body);
+    } else if (kind == "level") {
+      filter->kind_ = Kind::kLevel;
+      filter->patterns_ = split_(body);
+    } else {
+      return nullptr;
+    }
+    return filter;
+  }
+
+  const std::string &spec() const { return spec_; }
+  // unique per compiled filter, cache keys use it rather than the address
+  uint64_t id() const { return id_; }
+
+  // Copy the matching lines of `data` to `out`, which holds at least `size` bytes. Returns the bytes kept.
+  size_t apply(const char *data, size_t size, char *out) const {
+    if (kind_ == Kind::kSubstr) {
+      return apply_automaton_(data, size, out);
+    }
+    size_t kept = 0;
+    // the regex state sets, once per call rather than per line
+    std::vector<uint8_t> current(items_.size() + 1);
+    std::vector<uint8_t> next(items_.size() + 1);
+    const char *const end = data + size;
+    while (data < end) {
+      const char *line_end = static_cast<const char *>(memchr(data, '\n', end - data));
+      line_end = (line_end != nullptr) ? line_end + 1 : end;
+      const size_t length = line_end - data;
+      // the newline is not part of what is matched
+      const size_t text = (line_end[-1] == '\n') ? length - 1 : length;
+      if (kind_ == Kind::kRegex ? search_(data, data + text, &current, &next) : starts_with_(data, text)) {
+        memcpy(out + kept, data, length);
+        kept += length;
+      }
+      data = line_end;
+    }
+    return kept;
+  }
+
+ private:
+  inline static const int32_t kAlphabet = 256;
+
+  Filter(const std::string &spec, uint64_t id) : spec_(spec), id_(id) {}
+
+  static std::vector<std::string> split_(const std::string &body) {
+    std::vector<std::string> patterns;
+    for (size_t begin = 0; begin <= body.size();) {
+      size_t end = body.find('|', begin);
+      if (end == std::string::npos) {
+        end = body.size();
+      }
+      if (end > begin) {
+        patterns.push_back(body.substr(begin, end - begin));
+      }
+      begin = end + 1;
+    }
+    return patterns;
+  }
+
+  // Goto function completed with the failure links into a DFA, one row of kAlphabet next states per state.
+  void build_automaton_() {
+    next_.assign(kAlphabet, 0);
+    is_output_.assign(1, false);
+    for (const std::string &pattern : patterns_) {
+      int32_t state = 0;
+      for (const char c : pattern) {
+        int32_t &target = next_[state * kAlphabet + static_cast<uint8_t>(c)];
+        if (target == 0) {
+          target = is_output_.size();
+          next_.resize(next_.size() + kAlphabet, 0);
+          is_output_.push_back(false);
+        }
+        state = next_[state * kAlphabet + static_cast<uint8_t>(c)];
+      }
+      is_output_[state] = true;
+    }
+
+    // breadth first, a state's failure target is always complete before the state itself
+    std::vector<int32_t> fail(is_output_.size(), 0);
+    std::queue<int32_t> states;
+    for (int32_t c = 0; c < kAlphabet; ++c) {
+      if (next_[c] != 0) {
+        states.push(next_[c]);
+      }
+    }
+    while (!states.empty()) {
+      const int32_t state = states.front();
+      states.pop();
+      is_output_[state] = is_output_[state] || is_output_[fail[state]];
+      for (int32_t c = 0; c < kAlphabet; ++c) {
+        int32_t &target = next_[state * kAlphabet + c];
+        if (target != 0) {
+          fail[target] = next_[fail[state] * kAlphabet + c];
+          states.push(target);
+        } else {
+          target = next_[fail[state] * kAlphabet + c];
+        }
+      }
+    }
+  }
+
+  // One pass over the batch, the automaton is reset at every line start and a line is taken whole on its first
+  // match without looking at the rest of it.
+  size_t apply_automaton_(const char *data, size_t size, char *out) const {
+    size_t kept = 0;
+    size_t line_begin = 0;
+    int32_t state = 0;
+    for (size_t i = 0; i < size;) {
+      const uint8_t c = data[i];
+      if (c == '\n') {
+        line_begin = ++i;
+        state = 0;
+        continue;
+      }
+      state = next_[state * kAlphabet + c];
+      if (!is_output_[state]) {
+        ++i;
+        continue;
+      }
+      const char *newline = static_cast<const char *>(memchr(data + i, '\n', size - i));
+      const size_t line_end = (newline != nullptr) ? newline - data + 1 : size;
+      memcpy(out + kept, data + line_begin, line_end - line_begin);
+      kept += line_end - line_begin;
+      line_begin = i = line_end;
+      state = 0;
+    }
+    return kept;
+  }
+
+  bool starts_with_(const char *line, size_t size) const {
+    const bool is_bracket = (size > 0 && line[0] == '[');
+    for (const std::string &prefix : patterns_) {
+      if (size >= prefix.size() && memcmp(line, prefix.data(), prefix.size()) == 0) {
+        return true;
+      }
+      if (is_bracket && size - 1 >= prefix.size() && memcmp(line + 1, prefix.data(), prefix.size()) == 0) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // The regex as a sequence of atoms, each once, optional or repeated, '+' is the atom once and then repeated. '^'
+  // only anchors at the start and '$' only at the end, anywhere else they are literals as is a leading repeat.
+  void compile_regex_(const std::string &re) {
+    size_t i = 0;
+    if (i < re.size() && re[i] == '^') {
+      is_start_anchored_ = true;
+      ++i;
+    }
+    while (i < re.size()) {
+      if (re[i] == '$' && i + 1 == re.size()) {
+        is_end_anchored_ = true;
+        break;
+      }
+      Item item;
+      if (re[i] == '\\' && i + 1 < re.size()) {
+        item.c = re[i + 1];
+        i += 2;
+      } else {
+        item.is_any = (re[i] == '.');
+        item.c = re[i];
+        ++i;
+      }
+      const char repeat = (i < re.size()) ? re[i] : '\0';
+      if (repeat == '*' || repeat == '?') {
+        item.repeat = (repeat == '*') ? Repeat::kStar : Repeat::kOptional;
+        ++i;
+      } else if (repeat == '+') {
+        items_.push_back(item);
+        item.repeat = Repeat::kStar;
+        ++i;
+      }
+      items_.push_back(item);
+    }
+  }
+
+  // Add state `k`, the first k items matched, and what it reaches without taking a character.
+  void add_state_(size_t k, std::vector<uint8_t> *states) const {
+    while (!(*states)[k]) {
+      (*states)[k] = 1;
+      if (k == items_.size() || items_[k].repeat == Repeat::kOnce) {
+        return;
+      }
+      ++k;
+    }
+  }
+
+  // Simulates the regex as an NFA over the states in items_, every character is looked at once per state however
+  // the pattern is written, so no client can make a sender backtrack.
+  bool search_(const char *text, const char *end, std::vector<uint8_t> *current, std::vector<uint8_t> *next) const {
+    const size_t accept = items_.size();
+    std::fill(current->begin(), current->end(), 0);
+    add_state_(0, current);
+    for (; text < end; ++text) {
+      if ((*current)[accept] && !is_end_anchored_) {
+        return true;
+      }
+      std::fill(next->begin(), next->end(), 0);
+      bool is_alive = false;
+      for (size_t k = 0; k < accept; ++k) {
+        const Item &item = items_[k];
+        if ((*current)[k] && (item.is_any || item.c == *text)) {
+          add_state_((item.repeat == Repeat::kStar) ? k : k + 1, next);
+          is_alive = true;
+        }
+      }
+      if (!is_start_anchored_) {
+        add_state_(0, next);
+      } else if (!is_alive) {
+        return false;
+      }
+      current->swap(*next);
+    }
+    return (*current)[accept];
+  }
+
+ private:
+  const std::string spec_;
+  const uint64_t id_;
+  Kind kind_{Kind::kSubstr};
+  std::vector<std::string> patterns_;
+  // substr automaton
+  std::vector<int32_t> next_;
+  std::vector<uint8_t> is_output_;
+  // regex
+  enum class Repeat : uint8_t {
+    kOnce,
+    kOptional,
+    kStar,
+  };
+  struct Item {
+    char c{0};
+    bool is_any{false};
+    Repeat repeat{Repeat::kOnce};
+  };
+  std::vector<Item> items_;
+  bool is_start_anchored_{false};
+  bool is_end_anchored_{false};
+};
+
+#endif  // CHANNEL_FILTER_H
@@ -1,70 +1,227 @@
 #ifndef CHANNEL_LOG_H
 #define CHANNEL_LOG_H
 
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
 
-#include <algorithm>
-#include <unordered_map>
+// Highest level compiled in, 1 error to 4 debug. Calls above it are removed at compile time.
+#ifndef CHANNEL_LOG_LEVEL
+#define CHANNEL_LOG_LEVEL 4
+#endif
 
+// Diagnostics are formatted on the calling thread into a buffer of its own and written to stdout by a background
+// thread, a slow stdout never blocks a hot path. A full buffer drops the line and counts it in dropped().
+// raw() is the direct path for help text and fatal messages: formatted once and written right away.
 class Log {
  private:
-  inline static int32_t kLevel_ = 1;
+  inline static std::atomic<int32_t> kLevel_{1};
+
+  // One writing thread, the flusher reads. Positions only grow, the masked value is the offset.
+  struct Buffer {
+    inline static const size_t kSize = 64 * 1024;
+
+    char data[kSize];
+    std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> tail{0};
+  };
+
+  class Flusher {
+   public:
+    Flusher() {
+      thread_ = std::thread([this]() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (!stop_) {
+          condition_.wait_for(lock, std::chrono::milliseconds(kFlushMs));
+          lock.unlock();
+          drain();
+          lock.lock();
+        }
+      });
+    }
+
+    ~Flusher() {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+      }
+      condition_.notify_all();
+      thread_.join();
+      drain();
+    }
+
+    std::shared_ptr<Buffer> attach() {
+      std::shared_ptr<Buffer> buffer = std::make_shared<Buffer>();
+      std::lock_guard<std::mutex> lock(buffers_mutex_);
+      buffers_.push_back(buffer);
+      return buffer;
+    }
+
+    // Lines of one thread keep their order, lines of different threads are interleaved whole.
+    // Writes happen outside buffers_mutex_, so a thread logging its first line never waits on the sink.
+    void drain() {
+      std::lock_guard<std::mutex> drain_lock(drain_mutex_);
+      std::vector<std::shared_ptr<Buffer>> buffers;
+      {
+        std::lock_guard<std::mutex> lock(buffers_mutex_);
+        buffers = buffers_;
+      }
+      std::vector<Buffer *> gone;
+      for (const std::shared_ptr<Buffer> &pointer : buffers) {
+        Buffer &buffer = *pointer;
+        // only the list and this copy hold it, the thread is gone and wrote its last line before head is read
+        if (pointer.use_count() == 2) {
+          gone.push_back(&buffer);
+        }
+        const uint64_t head = buffer.head.load(std::memory_order_acquire);
+        uint64_t tail = buffer.tail.load(std::memory_order_relaxed);
+        while (tail < head) {
+          const size_t offset = tail % Buffer::kSize;
+          const size_t size = std::min<uint64_t>(head - tail, Buffer::kSize - offset);
+          write_(buffer.data + offset, size);
+          tail += size;
+        }
+        buffer.tail.store(tail, std::memory_order_release);
+      }
+      if (gone.empty()) {
+        return;
+      }
+      std::lock_guard<std::mutex> lock(buffers_mutex_);
+      buffers_.erase(std::remove_if(buffers_.begin(), buffers_.end(),
+                                    [&](const std::shared_ptr<Buffer> &pointer) {
+                                      return std::find(gone.begin(), gone.end(), pointer.get()) != gone.end();
+                                    }),
+                     buffers_.end());
+    }
+
+   private:
+    inline static const int64_t kFlushMs = 10;
+
+    std::mutex mutex_;
+    std::condition_variable condition_;
+    bool stop_{false};
+    std::thread thread_;
+
+    // one drain at a time, the flusher thread and flush() would otherwise write the same lines twice
+    std::mutex drain_mutex_;
+    std::mutex buffers_mutex_;
+    std::vector<std::shared_ptr<Buffer>> buffers_;
+  };
+
+  // Constructed on first use, destroyed at exit after a last drain.
+  static Flusher &flusher_() {
+    static Flusher flusher;
+    return flusher;
+  }
+
+  static Buffer &buffer_() {
+    thread_local std::shared_ptr<Buffer> buffer = flusher_().attach();
+    return *buffer;
+  }
 
-  template <typename... Args> inline static void print_(const char *format, Args &&... args) {
+  static void write_(const char *data, size_t size) {
+    while (size > 0) {
+      const ssize_t n = ::write(STDOUT_FILENO, data, size);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        return;
+      }
+      data += n;
+      size -= n;
+    }
+  }
+
+  template <typename... Args> static int format_(char *out, size_t size, const char *format, Args &&... args) {
     if constexpr (sizeof...(args) == 0) {
-      printf("%s", format);
+      return snprintf(out, size, "%s", format);
     } else {
-      printf(format, args...);
+      return snprintf(out, size, format, args...);
+    }
+  }
+
+  template <int32_t level, typename... Args>
+  static void print_(const char *name, const char *format, Args &&... args) {
+    if constexpr (level <= CHANNEL_LOG_LEVEL) {
+      if (__builtin_expect(kLevel_.load(std::memory_order_relaxed) < level, 1)) {
+        return;
+      }
+      // a longer line is cut, the newline is kept
+      char line[kMaxLine];
+      int length = snprintf(line, sizeof(line), "[%s] ", name);
+      length += std::max(0, format_(line + length, sizeof(line) - length, format, args...));
+      length = std::min<int>(length, sizeof(line) - 1);
+      line[length++] = '\n';
+      push_(line, length);
     }
   }
 
+  static void push_(const char *line, size_t size) {
+    Buffer &buffer = buffer_();
+    const uint64_t head = buffer.head.load(std::memory_order_relaxed);
+    if (head + size - buffer.tail.load(std::memory_order_acquire) > Buffer::kSize) {
+      dropped_.fetch_add(1, std::memory_order_relaxed);
+      return;
+    }
+    const size_t offset = head % Buffer::kSize;
+    const size_t first = std::min(size, Buffer::kSize - offset);
+    memcpy(buffer.data + offset, line, first);
+    memcpy(buffer.data, line + first, size - first);
+    buffer.head.store(head + size, std::memory_order_release);
+  }
+
+  inline static const size_t kMaxLine = 1024;
+  inline static std::atomic<uint64_t> dropped_{0};
+
  public:
   static void set_level(int32_t level) { kLevel_ = level; }
-  static int32_t get_level() { return kLevel_; }
+  static int32_t get_level() { return kLevel_.load(std::memory_order_relaxed); }
+
+  // Lines lost to a full buffer.
+  static uint64_t dropped() { return dropped_.load(std::memory_order_relaxed); }
+
+  // Write out what is buffered now, before output that has to come after it.
+  static void flush() { flusher_().drain(); }
 
   template <typename... Args> static void raw(const char *format, Args &&... args) {
-    print_(format, std::forward<Args>(args)...);
+    if constexpr (sizeof...(args) == 0) {
+      write_(format, strlen(format));
+    } else {
+      const int length = snprintf(nullptr, 0, format, args...);
+      if (length > 0) {
+        std::vector<char> out(length + 1);
+        snprintf(out.data(), out.size(), format, args...);
+        write_(out.data(), length);
+      }
+    }
   }
 
   template <typename... Args> static void error(const char *format, Args &&... args) {
-    constexpr const char name[] = "ERROR";
-    constexpr const int32_t level = 1;
-    if (get_level() >= level) {
-      printf("[%s] ", name);
-      print_(format, args...);
-      printf("\n");
-    }
+    print_<1>("ERROR", format, std::forward<Args>(args)...);
   }
 
   template <typename... Args> static void warn(const char *format, Args &&... args) {
-    constexpr const char name[] = "WARN";
-    constexpr const int32_t level = 2;
-    if (get_level() >= level) {
-      printf("[%s] ", name);
-      print_(format, args...);
-      printf("\n");
-    }
+    print_<2>("WARN", format, std::forward<Args>(args)...);
   }
 
   template <typename... Args> static void info(const char *format, Args &&... args) {
-    constexpr const char name[] = "INFO";
-    constexpr const int32_t level = 3;
-    if (get_level() >= level) {
-      printf("[%s] ", name);
-      print_(format, args...);
-      printf("\n");
-    }
+    print_<3>("INFO", format, std::forward<Args>(args)...);
   }
 
   template <typename... Args> static void debug(const char *format, Args &&... args) {
-    constexpr const char name[] = "DEBUG";
-    constexpr const int32_t level = 4;
-    if (get_level() >= level) {
-      printf("[%s] ", name);
-      print_(format, args...);
-      printf("\n");
-    }
+    print_<4>("DEBUG", format, std::forward<Args>(args)...);
   }
 };
 
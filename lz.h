@@ -0,0 +1,193 @@
+#ifndef CHANNEL_LZ_H
+#define CHANNEL_LZ_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+#include <memory>
+
+// Minimal LZ77 block codec in the LZ4 sequence layout: a token with literal and match length nibbles, the
+// literals, a 16 bit little endian offset and the length extensions. Good enough for log text, no dependency.
+class Lz {
+ public:
+  Lz() : table_(std::make_unique<uint32_t[]>(kTableSize)) {}
+
+  // worst case output size for `size` input bytes
+  static size_t bound(size_t size) { return size + size / 255 + 16; }
+
+  // Compress `size` bytes into `dst`, returns the compressed size or 0 if it does not fit in `capacity`.
+  size_t compress(const char *src, size_t size, char *dst, size_t capacity) {
+    const uint8_t *const in = reinterpret_cast<const uint8_t *>(src);
+    uint8_t *const out = reinterpret_cast<uint8_t *>(dst);
+    uint8_t *op = out;
+    uint8_t *const out_end = out + capacity;
+    size_t anchor = 0;
+
+    if (size >= kMinInput) {
+      std::fill(table_.get(), table_.get() + kTableSize, kEmpty);
+      const size_t match_limit = size - kLastLiterals;
+      const size_t search_limit = size - kMinInput + 1;
+      size_t ip = 0;
+      uint32_t misses = 0;
+      while (ip < search_limit) {
+        const uint32_t sequence = read32_(in + ip);
+        uint32_t &slot = table_[hash_(sequence)];
+        const uint32_t ref = slot;
+        slot = ip;
+        if (ref == kEmpty || ip - ref > kMaxOffset || read32_(in + ref) != sequence) {
+          ip += 1 + (misses++ >> 6);
+          continue;
+        }
+        misses = 0;
+
+        size_t match = kMinMatch;
+        while (ip + match < match_limit && in[ref + match] == in[ip + match]) {
+          ++match;
+        }
+        op = emit_(op, out_end, in + anchor, ip - anchor, ip - ref, match);
+        if (op == nullptr) {
+          return 0;
+        }
+        ip += match;
+        anchor = ip;
+      }
+    }
+
+    op = emit_(op, out_end, in + anchor, size - anchor, 0, 0);
+    return (op == nullptr) ? 0 : (op - out);
+  }
+
+  // Inflate `size` bytes of `src` into exactly `raw_size` bytes of `dst`, returns false on malformed input.
+  static bool decompress(const char *src, size_t size, char *dst, size_t raw_size) {
+    const uint8_t *ip = reinterpret_cast<const uint8_t *>(src);
+    const uint8_t *const in_end = ip + size;
+    uint8_t *const out = reinterpret_cast<uint8_t *>(dst);
+    uint8_t *op = out;
+    uint8_t *const out_end = out + raw_size;
+
+    while (ip < in_end) {
+      const uint8_t token = *ip++;
+      size_t literals = token >> 4;
+      if (literals == 15 && !read_length_(&ip, in_end, &literals)) {
+        return false;
+      }
+      if (literals > static_cast<size_t>(in_end - ip) || literals > static_cast<size_t>(out_end - op)) {
+        return false;
+      }
+      memcpy(op, ip, literals);
+      op += literals;
+      ip += literals;
+      if (ip == in_end) {
+        break;
+      }
+
+      if (in_end - ip < 2) {
+        return false;
+      }
+      const size_t offset = ip[0] | (ip[1] << 8);
+      ip += 2;
+      size_t match = token & 15;
+      if (match == 15 && !read_length_(&ip, in_end, &match)) {
+        return false;
+      }
+      match += kMinMatch;
+      if (offset == 0 || offset > static_cast<size_t>(op - out) || match > static_cast<size_t>(out_end - op)) {
+        return false;
+      }
+      const uint8_t *ref = op - offset;
+      if (offset >= match) {
+        memcpy(op, ref, match);
+        op += match;
+      } else {
+        // overlapping copy repeats the last `offset` bytes
+        for (size_t i = 0; i < match; ++i) {
+          *op++ = *ref++;
+        }
+      }
+    }
+    return op == out_end;
+  }
+
+ private:
+  inline static const uint32_t kTableBits = 12;
+  inline static const uint32_t kTableSize = 1u << kTableBits;
+  inline static const uint32_t kEmpty = UINT32_MAX;
+  inline static const size_t kMinMatch = 4;
+  inline static const size_t kMaxOffset = 65535;
+  // the block always ends with literals, which keeps the decoder simple
+  inline static const size_t kLastLiterals = 5;
+  inline static const size_t kMinInput = 13;
+
+  static uint32_t read32_(const uint8_t *data) {
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+  }
+
+  static uint32_t hash_(uint32_t sequence) { return (sequence * 2654435761u) >> (32 - kTableBits); }
+
+  static uint8_t *write_length_(uint8_t *op, uint8_t *out_end, size_t length) {
+    for (; length >= 255; length -= 255) {
+      if (op == out_end) {
+        return nullptr;
+      }
+      *op++ = 255;
+    }
+    if (op == out_end) {
+      return nullptr;
+    }
+    *op++ = static_cast<uint8_t>(length);
+    return op;
+  }
+
+  static bool read_length_(const uint8_t **ip, const uint8_t *in_end, size_t *length) {
+    uint8_t value = 255;
+    while (value == 255) {
+      if (*ip == in_end) {
+        return false;
+      }
+      value = *(*ip)++;
+      *length += value;
+    }
+    return true;
+  }
+
+  // One sequence: literals followed by a match, a zero `match` ends the block.
+  static uint8_t *emit_(uint8_t *op, uint8_t *out_end, const uint8_t *literals, size_t literal_length,
+                        size_t offset, size_t match) {
+    if (op == out_end) {
+      return nullptr;
+    }
+    uint8_t *token = op++;
+    *token = static_cast<uint8_t>(std::min<size_t>(literal_length, 15) << 4);
+    if (literal_length >= 15 && (op = write_length_(op, out_end, literal_length - 15)) == nullptr) {
+      return nullptr;
+    }
+    if (literal_length > static_cast<size_t>(out_end - op)) {
+      return nullptr;
+    }
+    memcpy(op, literals, literal_length);
+    op += literal_length;
+    if (match == 0) {
+      return op;
+    }
+
+    if (out_end - op < 2) {
+      return nullptr;
+    }
+    *op++ = static_cast<uint8_t>(offset);
+    *op++ = static_cast<uint8_t>(offset >> 8);
+    match -= kMinMatch;
+    *token |= static_cast<uint8_t>(std::min<size_t>(match, 15));
+    if (match >= 15 && (op = write_length_(op, out_end, match - 15)) == nullptr) {
+      return nullptr;
+    }
+    return op;
+  }
+
+ private:
+  std::unique_ptr<uint32_t[]> table_;
+};
+
+#endif  // CHANNEL_LZ_H
@@ -1,29 +1,119 @@
 #include "client.h"
 #include "log.h"
+#include "merge.h"
 #include "server.h"
 
 #include <csignal>
 #include <cstdint>
 #include <cstring>
 #include <iostream>
+#include <string>
+#include <vector>
 
 struct Config {
-  const char *ip{kDefaultIP};
+  std::string ip{kDefaultIP};
   uint16_t port{kDefaultPort};
   bool is_server{false};
   bool is_drop{true};
+  ServerOptions server;
+  ClientOptions client;
+  // -C arguments, what they mean depends on -s
+  std::vector<std::string> channels;
+  // -i arguments, a client given several merges them
+  std::vector<std::string> sources;
+  MergeOptions merge;
 };
 
+// Server side "name=path" or just "name" for stdin, client side comma separated names.
+void set_channels(Config *config) {
+  if (config->channels.empty()) {
+    return;
+  }
+  if (!config->is_server) {
+    for (const std::string &names : config->channels) {
+      for (size_t begin = 0; begin <= names.size();) {
+        const size_t end = std::min(names.find(',', begin), names.size());
+        config->client.channels.push_back(names.substr(begin, end - begin));
+        begin = end + 1;
+      }
+    }
+    return;
+  }
+  config->server.channels.clear();
+  for (const std::string &channel : config->channels) {
+    const size_t equal = channel.find('=');
+    ChannelOptions options;
+    options.name = channel.substr(0, equal);
+    options.path = (equal == std::string::npos) ? "-" : channel.substr(equal + 1);
+    config->server.channels.push_back(options);
+  }
+}
+
+// A non-negative decimal number, anything else ends the program.
+std::string parse_count(const char *arg, const char *option) {
+  const std::string value = arg;
+  if (value.empty() || value.size() > 19 || value.find_first_not_of("0123456789") != std::string::npos) {
+    Log::raw("Invalid number for %s: %s\n", option, arg);
+    exit(1);
+  }
+  return value;
+}
+
+// Client side "ip[:port]", without a port the one of -p stays.
+void set_source(const std::string &source, ClientOptions *options) {
+  const size_t colon = source.find(':');
+  options->ip = source.substr(0, colon);
+  if (colon != std::string::npos) {
+    const std::string port = parse_count(source.c_str() + colon + 1, "-i");
+    if (std::stoull(port) == 0 || std::stoull(port) > UINT16_MAX) {
+      Log::raw("Invalid port for -i: %s\n", source.c_str());
+      exit(1);
+    }
+    options->port = std::stoi(port);
+  }
+}
+
 Config get_config(int32_t argc, char *const argv[]) {
   Config config;
-  const char *opts = "sdhi:p:l:";
+  const char *opts = "sdhxbqzKTcGUi:p:l:m:r:n:t:k:f:w:j:C:F:S:R:M:H:W:";
   const char *help = "Usage: channel [options]\n"
                      "Options:\n"
                      "  -h\t\tShow this help message\n"
                      "  -s\t\tRun as server\n"
                      "  -d\t\tDisable drop\n"
-                     "  -i\t\tIP address\n"
-                     "  -p\t\tPort number\n";
+                     "  -S\t\tWith -d, spill what slow clients still need to files in this directory instead of\n"
+                     "    \t\tblocking the input\n"
+                     "  -R\t\tRelay the channels of the server at ip[:port] instead of reading stdin, -z and -c apply\n"
+                     "    \t\tto that connection\n"
+                     "  -b\t\tRead stdin in bulk chunks instead of line by line\n"
+                     "  -q\t\tDo not echo stdin\n"
+                     "  -i\t\tServer ip[:port], the port defaults to -p. A client given several merges them by\n"
+                     "    \t\ttimestamp and tags lines with [ip[:port]], -M, -H and -U do not apply then\n"
+                     "  -W\t\tMilliseconds a merging client holds a record for older ones from the other servers\n"
+                     "  -p\t\tPort number\n"
+                     "  -m\t\tMax bytes a client may lag behind, 0 for unlimited\n"
+                     "  -x\t\tDisconnect lagging clients instead of dropping their data\n"
+                     "  -k\t\tMax payload bytes per frame, up to 1048576, clients of the v1 wire format get at most\n"
+                     "    \t\t65535\n"
+                     "  -f\t\tMax frames per send\n"
+                     "  -w\t\tMicroseconds a small batch may wait for more data, 0 sends at once\n"
+                     "  -j\t\tSender threads sharing the clients\n"
+                     "  -C\t\tServer: add channel name=path, path - or none is stdin, repeatable\n"
+                     "    \t\tClient: subscribe to comma separated channels, lines get a [name] prefix with several\n"
+                     "  -M\t\tServer: also send every channel to the multicast group:port\n"
+                     "    \t\tClient: receive from the multicast group:port, -i and -p only serve channels and gaps\n"
+                     "  -H\t\tServer: also publish every channel to the shared memory object of this name\n"
+                     "    \t\tClient: read from it instead of a connection, on the same host, -F does not apply\n"
+                     "  -G\t\tFetch what the multicast group lost from the server instead of skipping it\n"
+                     "  -U\t\tUse io_uring for accepts, sends and receives when the kernel has it, epoll otherwise\n"
+                     "  -z\t\tAsk the server for compressed data\n"
+                     "  -K\t\tAsk the server for a CRC-32C of every frame and check it\n"
+                     "  -T\t\tStart every line with when the server read it, seconds since the epoch\n"
+                     "  -F\t\tOnly receive lines matching substr:a|b, regex:re or level:E|W\n"
+                     "  -r\t\tReplay the last bytes the server still has before the live data\n"
+                     "  -n\t\tReplay the server history from a message index on\n"
+                     "  -c\t\tKeep reconnecting and resume where the connection broke\n"
+                     "  -t\t\tPrint stats as JSON lines to stderr every given milliseconds, SIGUSR1 prints them once\n";
 
   for (int32_t opt_value = getopt(argc, argv, opts); opt_value != -1; opt_value = getopt(argc, argv, opts)) {
     switch (opt_value) {
@@ -32,6 +122,7 @@ Config get_config(int32_t argc, char *const argv[]) {
       break;
     case 'i':
       config.ip = optarg;
+      config.sources.push_back(optarg);
       break;
     case 'p':
       config.port = std::stoi(optarg);
@@ -39,6 +130,89 @@ Config get_config(int32_t argc, char *const argv[]) {
     case 'd':
       config.is_drop = false;
       break;
+    case 'S':
+      config.server.spill_dir = optarg;
+      break;
+    case 'R': {
+      config.server.is_relay = true;
+      const std::string upstream = optarg;
+      const size_t colon = upstream.find(':');
+      config.server.upstream.ip = upstream.substr(0, colon);
+      if (colon != std::string::npos) {
+        config.server.upstream.port = std::stoi(upstream.substr(colon + 1));
+      }
+      break;
+    }
+    case 'b':
+      config.server.is_bulk = true;
+      break;
+    case 'q':
+      config.server.is_echo = false;
+      break;
+    case 'z':
+      config.client.is_compress = true;
+      break;
+    case 'K':
+      config.client.is_checksum = true;
+      break;
+    case 'T':
+      config.client.is_timestamps = true;
+      break;
+    case 'M':
+      config.server.multicast = optarg;
+      config.client.multicast = optarg;
+      break;
+    case 'H':
+      config.server.shm = optarg;
+      config.client.shm = optarg;
+      break;
+    case 'G':
+      config.client.is_fetch = true;
+      break;
+    case 'U':
+      config.server.is_uring = true;
+      config.client.is_uring = true;
+      break;
+    case 'F':
+      config.client.filter = optarg;
+      break;
+    case 'c':
+      config.client.is_reconnect = true;
+      break;
+    case 't':
+      config.server.stats_interval_ms = std::stoll(optarg);
+      config.client.stats_interval_ms = config.server.stats_interval_ms;
+      break;
+    case 'r':
+      config.client.start = std::string("bytes:") + parse_count(optarg, "-r");
+      break;
+    case 'n':
+      config.client.start = std::string("index:") + parse_count(optarg, "-n");
+      break;
+    case 'm':
+      config.server.max_lag = std::stoull(optarg);
+      break;
+    case 'k':
+      config.server.batch.max_bytes = std::stoul(optarg);
+      break;
+    case 'f':
+      config.server.batch.max_frames = std::stoul(optarg);
+      break;
+    case 'w':
+      config.server.batch.linger_us = std::stoll(optarg);
+      break;
+    case 'j':
+      config.server.senders = std::stoi(optarg);
+      break;
+    case 'C':
+      config.channels.push_back(optarg);
+      break;
+    case 'W':
+      config.merge.window_ms = std::stoll(optarg);
+      break;
+    case 'x':
+      config.server.lag_policy = LagPolicy::kDisconnect;
+      break;
     case 'h':
       Log::raw("%s", help);
       exit(0);
@@ -53,21 +227,52 @@ Config get_config(int32_t argc, char *const argv[]) {
     }
   }
 
+  set_channels(&config);
+  config.server.port = config.port;
+  config.client.ip = config.ip;
+  config.server.upstream.is_compress = config.client.is_compress;
+  config.server.upstream.is_checksum = config.client.is_checksum;
+  config.server.upstream.is_reconnect = config.client.is_reconnect;
+  config.server.upstream.stats_interval_ms = config.client.stats_interval_ms;
+  config.server.upstream.is_uring = config.client.is_uring;
+  config.client.port = config.port;
+  if (!config.is_server && config.sources.size() == 1) {
+    set_source(config.sources.front(), &config.client);
+  }
+  if (!config.is_server && config.sources.size() > 1) {
+    // a merge only drives TCP connections
+    if (!config.client.multicast.empty() || !config.client.shm.empty() || config.client.is_uring) {
+      Log::raw("-M, -H and -U do not go with several -i\n");
+      exit(1);
+    }
+    for (const std::string &source : config.sources) {
+      ClientOptions options = config.client;
+      set_source(source, &options);
+      options.source = source;
+      config.merge.sources.push_back(options);
+    }
+  }
   return config;
 }
 
 int32_t main(int32_t argc, char *const argv[]) {
   const Config config = get_config(argc, argv);
+  signal(SIGUSR1, Stats::request);
   try {
     if (config.is_server) {
       Log::debug("Running as server");
       // echo "hello world" | channel -s
-      std::unique_ptr<Server> server = std::make_unique<Server>(config.port);
+      std::unique_ptr<Server> server = std::make_unique<Server>(config.server);
       server->send_message(config.is_drop);
+    } else if (!config.merge.sources.empty()) {
+      Log::debug("Running as client of %lu servers", config.merge.sources.size());
+      // channel -i 10.0.0.1 -i 10.0.0.2
+      std::unique_ptr<Merge> merge = std::make_unique<Merge>(config.merge);
+      merge->recv_message();
     } else {
       Log::debug("Running as client");
       // channel
-      std::unique_ptr<Client> client = std::make_unique<Client>(config.ip, config.port);
+      std::unique_ptr<Client> client = std::make_unique<Client>(config.client);
       client->recv_message();
     }
   } catch (const char *message) {
@@ -0,0 +1,326 @@
+#ifndef CHANNEL_MERGE_H
+#define CHANNEL_MERGE_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "client.h"
+#include "config.h"
+#include "log.h"
+#include "stats.h"
+#include "utils.h"
+
+struct MergeOptions {
+  // one per server, with its ip, port and source set, the rest as for a single client
+  std::vector<ClientOptions> sources;
+  // how long a record is held for older ones from the other servers
+  int64_t window_ms{kMergeWindowMs};
+};
+
+// Receives from several servers in one epoll loop and writes their records to stdout in the order the servers read
+// them. Each connection keeps its own frame parser and clock offset, timestamps are taken to this host's clock with
+// it and the sources are merged k-way on them. A record waits out the window before it goes, so that an older one
+// from a server that is a bit behind still goes first. Records of one server keep their order, every line starts
+// with its server's [source].
+class Merge {
+ public:
+  Merge(const MergeOptions &options) : options_(options), stats_("merge", options.sources.front().stats_interval_ms) {
+    for (const ClientOptions &client_options : options_.sources) {
+      std::unique_ptr<Source> source = std::make_unique<Source>();
+      source->client = std::make_unique<Client>(client_options);
+      // connected in the loop, client_socket_ tells whether it is
+      close(source->client->client_socket_);
+      source->client->client_socket_ = -1;
+      source->prefix = "[" + client_options.source + "] ";
+      const uint32_t index = sources_.size();
+      source->client->handler_ = [this, index](const RelayFrame &frame) {
+        push_(index, frame);
+        return true;
+      };
+      sources_.push_back(std::move(source));
+    }
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ < 0) {
+      throw "Failed to create epoll\n";
+    }
+    stats_.add("merged_records", &merged_records_);
+    stats_.add("late_records", &late_records_);
+    stats_.add("forced_records", &forced_records_);
+    stats_.add("buffered_bytes", &buffered_bytes_);
+    stats_.start();
+  }
+
+  ~Merge() {
+    if (epoll_fd_ >= 0) {
+      close(epoll_fd_);
+    }
+  }
+
+  Merge(const Merge &) = delete;
+  Merge &operator=(const Merge &) = delete;
+
+  // Until the output fails or every server is gone for good, without reconnects that is once each closed.
+  void recv_message() {
+    Writer writer(STDOUT_FILENO);
+    const int64_t window_us = options_.window_ms * 1000;
+    struct epoll_event events[kMaxEvents];
+    while (true) {
+      const int64_t now_us = Message::steady_us();
+      bool is_live = false;
+      for (uint32_t i = 0; i < sources_.size(); ++i) {
+        Source &source = *sources_[i];
+        Client *client = source.client.get();
+        if (client->client_socket_ < 0 && !source.is_done && now_us >= source.next_connect_us) {
+          connect_(i);
+        }
+        if (client->client_socket_ >= 0 && now_us >= source.next_ping_us) {
+          client->ping_();
+          source.next_ping_us = now_us + kPingIntervalMs * 1000;
+        }
+        is_live |= !source.is_done;
+      }
+      if (!is_live) {
+        break;
+      }
+      // wake for the oldest held record, pings and reconnects are fine a window late
+      const int64_t timeout_ms = heads_.empty() ? options_.window_ms : std::clamp<int64_t>(
+          (heads_.top().first + window_us - Message::timestamp_us() + 999) / 1000, 0, options_.window_ms);
+      const int32_t nfds = epoll_wait(epoll_fd_, events, kMaxEvents, timeout_ms);
+      if (nfds < 0 && errno != EINTR) {
+        Log::error("Failed to wait for epoll");
+        break;
+      }
+      for (int32_t i = 0; i < nfds; ++i) {
+        receive_(events[i].data.u32, &writer);
+      }
+      emit_(&writer, Message::timestamp_us() - window_us);
+      if (!writer.flush()) {
+        Log::error("Failed to write output");
+        return;
+      }
+    }
+    emit_(&writer, INT64_MAX);
+    writer.flush();
+  }
+
+ private:
+  inline static const int32_t kMaxEvents = 64;
+
+  // A record held in its source's bytes.
+  struct Entry {
+    // in this host's clock
+    int64_t timestamp{0};
+    uint32_t channel{0};
+    uint32_t size{0};
+  };
+
+  struct Source {
+    std::unique_ptr<Client> client;
+    // of the current connection
+    std::unique_ptr<Receiver> receiver;
+    std::unique_ptr<char[]> inflated = std::make_unique<char[]>(kRecvBufferSize);
+    std::string prefix{""};
+    // channel names as records came, Entry::channel points in here, and where their lines are
+    std::vector<std::string> channels;
+    std::vector<std::string> channel_prefixes;
+    std::vector<bool> is_line_start;
+    // held records in arrival order, their payloads back to back in bytes from bytes_head on
+    std::deque<Entry> entries;
+    std::string bytes{""};
+    size_t bytes_head{0};
+    int64_t next_ping_us{0};
+    int64_t next_connect_us{0};
+    int64_t backoff_ms{kReconnectMinDelayMs};
+    // since when it is down, 0 before the first connection
+    int64_t disconnected_us{0};
+    // closed and not to be reconnected
+    bool is_done{false};
+  };
+
+  void connect_(uint32_t index) {
+    Source &source = *sources_[index];
+    Client *client = source.client.get();
+    if (client->client_socket_ < 0) {
+      client->client_socket_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    }
+    // a server that is down must not stall the others, connect() gives up after the send timeout
+    struct timeval timeout = {kMergeConnectTimeoutMs / 1000, (kMergeConnectTimeoutMs % 1000) * 1000};
+    if (client->client_socket_ >= 0) {
+      setsockopt(client->client_socket_, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u32 = index;
+    if (client->client_socket_ < 0 || !client->connect_() ||
+        epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, client->client_socket_, &event) < 0) {
+      disconnected_(index, "Failed to connect");
+      return;
+    }
+    if (source.disconnected_us > 0) {
+      const int64_t disconnected_for_us = Message::steady_us() - source.disconnected_us;
+      ++client->reconnects_;
+      client->disconnected_us_ += disconnected_for_us;
+      Log::info("Reconnected to %s after %ld ms", client->options_.source.c_str(), disconnected_for_us / 1000);
+    }
+    source.backoff_ms = kReconnectMinDelayMs;
+    source.disconnected_us = 0;
+    source.next_ping_us = 0;
+    source.receiver = std::make_unique<Receiver>(kRecvBufferSize);
+    for (auto &[id, stream] : client->streams_) {
+      stream.recv_bytes = 0;
+    }
+  }
+
+  // The connection of a source failed or ended, retry it with backoff or give it up.
+  void disconnected_(uint32_t index, const char *reason) {
+    Source &source = *sources_[index];
+    Client *client = source.client.get();
+    if (client->client_socket_ >= 0) {
+      close(client->client_socket_);
+      client->client_socket_ = -1;
+    }
+    if (!client->options_.is_reconnect) {
+      Log::error("%s: %s", client->options_.source.c_str(), reason);
+      source.is_done = true;
+      return;
+    }
+    const int64_t now_us = Message::steady_us();
+    Log::debug("%s: %s, retry in %ld ms", client->options_.source.c_str(), reason, source.backoff_ms);
+    source.disconnected_us = (source.disconnected_us > 0) ? source.disconnected_us : now_us;
+    source.next_connect_us = now_us + source.backoff_ms * 1000;
+    source.backoff_ms = std::min(source.backoff_ms * 2, kReconnectMaxDelayMs);
+  }
+
+  // Read what a source's socket has, its records are taken in by push_() on the way.
+  void receive_(uint32_t index, Writer *writer) {
+    Source &source = *sources_[index];
+    Client *client = source.client.get();
+    if (client->client_socket_ < 0) {
+      return;
+    }
+    const ssize_t read_bytes = source.receiver->fill(client->client_socket_);
+    if (read_bytes <= 0) {
+      if (read_bytes < 0 && (errno == EINTR || errno == EAGAIN)) {
+        return;
+      }
+      disconnected_(index, "Connection closed");
+      return;
+    }
+    bool is_output_ok = true;
+    if (!client->deliver_(source.receiver.get(), writer, source.inflated.get(), &is_output_ok)) {
+      disconnected_(index, "Invalid data");
+      return;
+    }
+    source.receiver->compact();
+  }
+
+  void push_(uint32_t index, const RelayFrame &frame) {
+    Source &source = *sources_[index];
+    // nothing points into the bytes between flushes, what went out can go
+    if (source.bytes_head > 0 && source.bytes_head >= source.bytes.size() / 2) {
+      source.bytes.erase(0, source.bytes_head);
+      source.bytes_head = 0;
+    }
+    uint32_t channel = 0;
+    while (channel < source.channels.size() && source.channels[channel] != *frame.channel) {
+      ++channel;
+    }
+    if (channel == source.channels.size()) {
+      source.channels.push_back(*frame.channel);
+      source.channel_prefixes.push_back("[" + *frame.channel + "] ");
+      source.is_line_start.push_back(true);
+    }
+    if (source.entries.empty()) {
+      heads_.push({frame.generate_timestamp, index});
+    }
+    source.entries.push_back({frame.generate_timestamp, channel, static_cast<uint32_t>(frame.size)});
+    source.bytes.append(frame.data, frame.size);
+    buffered_bytes_ += frame.size;
+  }
+
+  // Write out every held record older than `cutoff`, oldest first, and the oldest of all while too much is held.
+  void emit_(Writer *writer, int64_t cutoff) {
+    while (!heads_.empty()) {
+      const auto [timestamp, index] = heads_.top();
+      const bool is_forced = buffered_bytes_ > kMergeBufferBytes;
+      if (timestamp > cutoff && !is_forced) {
+        break;
+      }
+      heads_.pop();
+      Source &source = *sources_[index];
+      const Entry entry = source.entries.front();
+      source.entries.pop_front();
+      if (!source.entries.empty()) {
+        heads_.push({source.entries.front().timestamp, index});
+      }
+      output_(writer, &source, entry);
+      source.bytes_head += entry.size;
+      buffered_bytes_ -= entry.size;
+      ++merged_records_;
+      if (is_forced && timestamp > cutoff) {
+        ++forced_records_;
+      }
+      if (timestamp < last_timestamp_) {
+        ++late_records_;
+      }
+      last_timestamp_ = std::max(last_timestamp_, timestamp);
+    }
+  }
+
+  void output_(Writer *writer, Source *source, const Entry &entry) {
+    const ClientOptions &options = source->client->options_;
+    const bool is_prefixed = options.channels.size() > 1;
+    char timestamp[32];
+    const int32_t timestamp_size =
+        options.is_timestamps
+            ? snprintf(timestamp, sizeof(timestamp), "%ld.%06ld ", entry.timestamp / 1000000, entry.timestamp % 1000000)
+            : 0;
+    const char *data = source->bytes.data() + source->bytes_head;
+    const char *const end = data + entry.size;
+    while (data < end) {
+      const char *line_end = static_cast<const char *>(memchr(data, '\n', end - data));
+      line_end = (line_end != nullptr) ? line_end + 1 : end;
+      if (source->is_line_start[entry.channel]) {
+        writer->copy(timestamp, timestamp_size);
+        writer->add(source->prefix.data(), source->prefix.size());
+        if (is_prefixed) {
+          writer->add(source->channel_prefixes[entry.channel].data(), source->channel_prefixes[entry.channel].size());
+        }
+      }
+      writer->add(data, line_end - data);
+      source->is_line_start[entry.channel] = (line_end[-1] == '\n');
+      data = line_end;
+    }
+  }
+
+  const MergeOptions options_;
+  std::vector<std::unique_ptr<Source>> sources_;
+  int32_t epoll_fd_{-1};
+  // the timestamp of every source's oldest held record, the k-way merge
+  std::priority_queue<std::pair<int64_t, uint32_t>, std::vector<std::pair<int64_t, uint32_t>>, std::greater<>> heads_;
+  int64_t last_timestamp_{INT64_MIN};
+
+  std::atomic<uint64_t> merged_records_{0};
+  // written after a younger one, the window was too short for them
+  std::atomic<uint64_t> late_records_{0};
+  // written before their window was over because too much was held
+  std::atomic<uint64_t> forced_records_{0};
+  std::atomic<uint64_t> buffered_bytes_{0};
+  Stats stats_;
+};
+
+#endif  // CHANNEL_MERGE_H
@@ -0,0 +1,602 @@
+#ifndef CHANNEL_RING_H
+#define CHANNEL_RING_H
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "config.h"
+#include "log.h"
+
+// Single producer, multiple consumer broadcast ring. Several producers take turns under a lock of their own.
+// Payloads are stored back to back in one byte buffer, records only keep their position, so any range of records
+// maps to at most two contiguous spans. Each consumer owns a reader slot with its own cursor (a record sequence).
+// With spilling enabled a blocking write does not wait for slow readers, what they still need is copied to segment
+// files first and they continue from there, see enable_spill().
+class Ring {
+ public:
+  struct Record {
+    int64_t generate_timestamp{0};
+    uint64_t position{0};
+    uint32_t length{0};
+    // relays the record passed and when it arrived at the last one, 0 for what was read here
+    uint32_t hops{0};
+    int64_t relay_timestamp{0};
+  };
+
+  struct Span {
+    const char *data{nullptr};
+    size_t size{0};
+  };
+
+  // A run of spilled records in one mmap'd file: the record table, then the payload back to back.
+  class Segment {
+   public:
+    Segment(const std::string &path, uint64_t first_seq, uint64_t first_position)
+        : path_(path), first_seq_(first_seq), first_position_(first_position), end_seq_(first_seq) {
+      fd_ = open(path_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+      if (fd_ < 0) {
+        return;
+      }
+      if (ftruncate(fd_, kSize) < 0) {
+        return;
+      }
+      void *base = mmap(nullptr, kSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+      if (base != MAP_FAILED) {
+        base_ = static_cast<char *>(base);
+      }
+    }
+
+    ~Segment() {
+      if (base_ != nullptr) {
+        munmap(base_, kSize);
+      }
+      if (fd_ >= 0) {
+        close(fd_);
+        unlink(path_.c_str());
+      }
+    }
+
+    Segment(const Segment &) = delete;
+    Segment &operator=(const Segment &) = delete;
+
+    bool is_open() const { return base_ != nullptr; }
+    uint64_t first_seq() const { return first_seq_; }
+    uint64_t end_seq() const { return end_seq_.load(std::memory_order_acquire); }
+
+    // producer side, false once the segment is full
+    bool append(uint64_t seq, const Record &record, const Span spans[2], int32_t count) {
+      const uint64_t offset = record.position - first_position_;
+      if (seq - first_seq_ >= kRecords || offset + record.length > kBytes) {
+        return false;
+      }
+      char *data = base_ + kRecords * sizeof(Record) + offset;
+      for (int32_t i = 0; i < count; ++i) {
+        memcpy(data, spans[i].data, spans[i].size);
+        data += spans[i].size;
+      }
+      reinterpret_cast<Record *>(base_)[seq - first_seq_] = record;
+      end_seq_.store(seq + 1, std::memory_order_release);
+      return true;
+    }
+
+   private:
+    friend class Ring;
+    inline static const uint64_t kRecords = kSpillSegmentRecords;
+    inline static const uint64_t kBytes = kSpillSegmentBytes;
+    inline static const uint64_t kSize = kRecords * sizeof(Record) + kBytes;
+
+    const std::string path_;
+    int32_t fd_{-1};
+    char *base_{nullptr};
+    const uint64_t first_seq_;
+    const uint64_t first_position_;
+    std::atomic<uint64_t> end_seq_;
+  };
+
+  // Where a run of records lives, the ring itself or one spilled segment, which the window keeps mapped. Records
+  // and payload are addressed as in the ring, a segment simply never wraps.
+  class Window {
+   public:
+    const Record &record(uint64_t seq) const { return records_[(seq - seq_base_) & records_mask_]; }
+
+    // Resolve the payload bytes [begin, end) into at most two spans, returns the number of spans.
+    int32_t spans(uint64_t begin, uint64_t end, Span spans[2]) const {
+      if (begin >= end) {
+        return 0;
+      }
+      const uint64_t offset = (begin - position_base_) & bytes_mask_;
+      const uint64_t size = end - begin;
+      const uint64_t first = std::min(size, bytes_mask_ + 1 - offset);
+      spans[0] = {bytes_ + offset, first};
+      if (first == size) {
+        return 1;
+      }
+      spans[1] = {bytes_, size - first};
+      return 2;
+    }
+
+    // first sequence past the window
+    uint64_t end_seq() const { return segment_ ? segment_->end_seq() : kIdle; }
+    bool is_spilled() const { return segment_ != nullptr; }
+
+   private:
+    friend class Ring;
+    const Record *records_{nullptr};
+    uint64_t records_mask_{0};
+    uint64_t seq_base_{0};
+    const char *bytes_{nullptr};
+    uint64_t bytes_mask_{0};
+    uint64_t position_base_{0};
+    std::shared_ptr<const Segment> segment_;
+  };
+
+  inline static const uint64_t kIdle = UINT64_MAX;
+  inline static const int32_t kMaxReaders = kMaxClientConnections;
+
+  // `waiters` consumer threads can sleep on the ring at the same time, each on its own eventfd.
+  Ring(uint64_t bytes_capacity, uint64_t records_capacity, int32_t waiters = 1)
+      : bytes_capacity_(round_up_(bytes_capacity)), records_capacity_(round_up_(records_capacity)),
+        waiter_count_(waiters) {
+    // left uninitialized, pages of an idle ring are never touched
+    bytes_ = std::unique_ptr<char[]>(new char[bytes_capacity_]);
+    records_ = std::make_unique<Record[]>(records_capacity_);
+    readers_ = std::make_unique<Reader[]>(kMaxReaders);
+    waiters_ = std::make_unique<Waiter[]>(waiter_count_);
+    for (int32_t i = 0; i < waiter_count_; ++i) {
+      waiters_[i].event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      if (waiters_[i].event_fd < 0) {
+        throw "Failed to create ring eventfd\n";
+      }
+    }
+  }
+
+  ~Ring() {
+    for (int32_t i = 0; i < waiter_count_; ++i) {
+      close(waiters_[i].event_fd);
+    }
+  }
+
+  // Spill instead of blocking, to segment files named `prefix` plus a number. Call before any write.
+  void enable_spill(const std::string &prefix) { spill_prefix_ = prefix; }
+
+  // payload bytes spilled so far and segments still on disk
+  const std::atomic<uint64_t> &spill_bytes() const { return spill_bytes_; }
+  const std::atomic<uint64_t> &spill_segments() const { return spill_segments_; }
+
+  Ring(const Ring &) = delete;
+  Ring &operator=(const Ring &) = delete;
+
+  // producer side
+
+  // Append one record. Without drop the call blocks while the slowest reader still needs the space, with drop the
+  // oldest records are reclaimed and lagging readers notice the overrun on their next acquire.
+  // Returns false if the ring was stopped while waiting.
+  bool write(const char *data, uint32_t size, int64_t generate_timestamp, bool is_drop, uint32_t hops = 0,
+             int64_t relay_timestamp = 0) {
+    if (size > bytes_capacity_) {
+      return false;
+    }
+    if (!reserve_(size, is_drop)) {
+      return false;
+    }
+    copy_in_(write_position_, data, size);
+    commit(size, generate_timestamp, hops, relay_timestamp);
+    return true;
+  }
+
+  // Write a record in place: reserve() returns where up to `size` bytes of it go, as write() makes room for them,
+  // then commit() publishes the `size` bytes actually used. nullptr where the bytes would wrap around the end of the
+  // ring, or if the ring was stopped while waiting, write() has to do then. Nothing else may be written in between.
+  char *reserve(uint32_t size, bool is_drop) {
+    const uint64_t offset = write_position_ & (bytes_capacity_ - 1);
+    if (size > bytes_capacity_ - offset || !reserve_(size, is_drop)) {
+      return nullptr;
+    }
+    return bytes_.get() + offset;
+  }
+
+  void commit(uint32_t size, int64_t generate_timestamp, uint32_t hops = 0, int64_t relay_timestamp = 0) {
+    const uint64_t head = head_.load(std::memory_order_relaxed);
+    Record &record = records_[head & (records_capacity_ - 1)];
+    record.generate_timestamp = generate_timestamp;
+    record.position = write_position_;
+    record.length = size;
+    record.hops = hops;
+    record.relay_timestamp = relay_timestamp;
+    write_position_ += size;
+    written_.store(write_position_, std::memory_order_relaxed);
+
+    head_.store(head + 1, std::memory_order_seq_cst);
+    for (int32_t i = 0; i < waiter_count_; ++i) {
+      Waiter &waiter = waiters_[i];
+      if (waiter.sleeping.load(std::memory_order_seq_cst) && waiter.sleeping.exchange(false)) {
+        const uint64_t one = 1;
+        (void)!::write(waiter.event_fd, &one, sizeof(one));
+      }
+    }
+  }
+
+  // Wake every waiter and refuse further blocking writes.
+  void stop() {
+    stop_ = true;
+    const uint64_t one = 1;
+    for (int32_t i = 0; i < waiter_count_; ++i) {
+      (void)!::write(waiters_[i].event_fd, &one, sizeof(one));
+    }
+    std::lock_guard<std::mutex> lock(space_mutex_);
+    space_condition_.notify_all();
+  }
+
+  // Block until every attached reader has consumed everything and at least one reader has seen it.
+  void wait_drained() {
+    std::unique_lock<std::mutex> lock(space_mutex_);
+    while (!stop_) {
+      const uint64_t head = head_.load();
+      trim_spill_(min_cursor_(head));
+      if (delivered_.load() >= head && min_cursor_(head) >= head) {
+        break;
+      }
+      space_waiting_ = true;
+      space_condition_.wait_for(lock, std::chrono::milliseconds(100));
+    }
+  }
+
+  // consumer side
+
+  // Attach a reader starting at `cursor`, returns the reader slot or -1 if all slots are taken.
+  int32_t attach(uint64_t cursor) {
+    for (int32_t i = 0; i < kMaxReaders; ++i) {
+      uint64_t expected = kIdle;
+      if (readers_[i].cursor.compare_exchange_strong(expected, cursor)) {
+        int32_t high = readers_high_.load();
+        while (high <= i && !readers_high_.compare_exchange_weak(high, i + 1)) {
+        }
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  void detach(int32_t reader) {
+    if (reader < 0) {
+      return;
+    }
+    readers_[reader].pin.store(kIdle);
+    readers_[reader].cursor.store(kIdle);
+    notify_space_();
+  }
+
+  // Where a new reader picks up by default: whatever no reader has been handed yet.
+  uint64_t start() const { return std::max(delivered_.load(), spill_tail_()); }
+
+  // Pin the reader at `cursor` so the producer cannot reclaim from under it. If the producer already overran the
+  // cursor it is moved to the oldest retained record and the number of lost records is stored in `dropped`.
+  // A cursor in a spilled segment needs no pin, window() keeps the segment.
+  uint64_t acquire(int32_t reader, uint64_t cursor, uint64_t *dropped) {
+    *dropped = 0;
+    Reader &slot = readers_[reader];
+    while (true) {
+      slot.pin.store(cursor, std::memory_order_seq_cst);
+      const uint64_t tail = tail_.load(std::memory_order_seq_cst);
+      if (cursor >= tail) {
+        return cursor;
+      }
+      slot.pin.store(kIdle, std::memory_order_seq_cst);
+      const uint64_t spilled = spilled_from_(cursor, tail);
+      *dropped += spilled - cursor;
+      cursor = spilled;
+      if (cursor < tail) {
+        return cursor;
+      }
+    }
+  }
+
+  // The records from `seq` on, the reader has to be acquired at or below `seq`. In the ring the window ends with the
+  // ring, in a segment with the segment.
+  Window window(uint64_t seq) const {
+    Window window;
+    if (seq >= tail_.load(std::memory_order_acquire)) {
+      window.records_ = records_.get();
+      window.records_mask_ = records_capacity_ - 1;
+      window.bytes_ = bytes_.get();
+      window.bytes_mask_ = bytes_capacity_ - 1;
+      return window;
+    }
+    std::lock_guard<std::mutex> lock(spill_mutex_);
+    for (const auto &segment : segments_) {
+      if (seq >= segment->first_seq() && seq < segment->end_seq()) {
+        window.records_ = reinterpret_cast<const Record *>(segment->base_);
+        window.records_mask_ = UINT64_MAX;
+        window.seq_base_ = segment->first_seq();
+        window.bytes_ = segment->base_ + Segment::kRecords * sizeof(Record);
+        window.bytes_mask_ = UINT64_MAX;
+        window.position_base_ = segment->first_position_;
+        window.segment_ = segment;
+        break;
+      }
+    }
+    return window;
+  }
+
+  // Move the reader cursor forward and drop the pin.
+  void release(int32_t reader, uint64_t cursor) {
+    Reader &slot = readers_[reader];
+    slot.cursor.store(cursor, std::memory_order_seq_cst);
+    slot.pin.store(kIdle, std::memory_order_seq_cst);
+    uint64_t delivered = delivered_.load();
+    while (delivered < cursor && !delivered_.compare_exchange_weak(delivered, cursor)) {
+    }
+    notify_space_();
+  }
+
+  uint64_t head() const { return head_.load(std::memory_order_acquire); }
+  // payload bytes written so far, for rate estimates
+  uint64_t written() const { return written_.load(std::memory_order_relaxed); }
+  uint64_t tail() const { return tail_.load(std::memory_order_acquire); }
+
+  // Only valid while the reader is pinned at or below `seq`.
+  const Record &record(uint64_t seq) const { return records_[seq & (records_capacity_ - 1)]; }
+
+  // First sequence in [begin, head] for which `is_at(record, seq)` holds, head if none does. The predicate has to
+  // be monotonic over the sequence. Only valid while the reader is pinned at or below `begin`.
+  template <typename Predicate> uint64_t bisect(uint64_t begin, uint64_t head, Predicate is_at) const {
+    uint64_t low = begin;
+    uint64_t high = head;
+    while (low < high) {
+      const uint64_t middle = low + (high - low) / 2;
+      if (is_at(record(middle), middle)) {
+        high = middle;
+      } else {
+        low = middle + 1;
+      }
+    }
+    return low;
+  }
+
+  // Resolve the payload bytes [begin, end) into at most two spans, returns the number of spans.
+  int32_t spans(uint64_t begin, uint64_t end, Span spans[2]) const {
+    if (begin >= end) {
+      return 0;
+    }
+    const uint64_t offset = begin & (bytes_capacity_ - 1);
+    const uint64_t size = end - begin;
+    const uint64_t first = std::min(size, bytes_capacity_ - offset);
+    spans[0] = {bytes_.get() + offset, first};
+    if (first == size) {
+      return 1;
+    }
+    spans[1] = {bytes_.get(), size - first};
+    return 2;
+  }
+
+  // Readable whenever new records may have been published, for use with poll/epoll.
+  int32_t event_fd(int32_t waiter = 0) const { return waiters_[waiter].event_fd; }
+
+  // Ask the producer to signal event_fd() on the next write. Returns false if there is already data past `cursor`,
+  // in which case the caller should not go to sleep.
+  bool arm(uint64_t cursor, int32_t waiter = 0) {
+    std::atomic<bool> &sleeping = waiters_[waiter].sleeping;
+    sleeping.store(true, std::memory_order_seq_cst);
+    if (head_.load(std::memory_order_seq_cst) > cursor || stop_) {
+      sleeping.store(false);
+      return false;
+    }
+    return true;
+  }
+
+  void disarm(int32_t waiter = 0) {
+    uint64_t value = 0;
+    (void)!::read(waiters_[waiter].event_fd, &value, sizeof(value));
+  }
+
+  // Sleep until something is published past `cursor`, the ring is stopped or the timeout expires.
+  void wait(uint64_t cursor, int32_t timeout_ms, int32_t waiter = 0) {
+    if (!arm(cursor, waiter)) {
+      return;
+    }
+    struct pollfd fd = {waiters_[waiter].event_fd, POLLIN, 0};
+    poll(&fd, 1, timeout_ms);
+    disarm(waiter);
+  }
+
+ private:
+  struct Reader {
+    std::atomic<uint64_t> cursor{kIdle};
+    std::atomic<uint64_t> pin{kIdle};
+  };
+
+  struct Waiter {
+    int32_t event_fd{-1};
+    std::atomic<bool> sleeping{false};
+  };
+
+  static uint64_t round_up_(uint64_t value) {
+    uint64_t result = 1;
+    while (result < value) {
+      result <<= 1;
+    }
+    return result;
+  }
+
+  void copy_in_(uint64_t position, const char *data, uint64_t size) {
+    const uint64_t offset = position & (bytes_capacity_ - 1);
+    const uint64_t first = std::min(size, bytes_capacity_ - offset);
+    memcpy(bytes_.get() + offset, data, first);
+    if (first < size) {
+      memcpy(bytes_.get(), data + first, size - first);
+    }
+  }
+
+  // Lowest cursor over the attached readers, or what was already handed out when nobody is attached so that
+  // blocking writes keep the backlog for the next reader.
+  uint64_t min_cursor_(uint64_t head) const {
+    uint64_t result = kIdle;
+    const int32_t high = readers_high_.load();
+    for (int32_t i = 0; i < high; ++i) {
+      result = std::min(result, readers_[i].cursor.load());
+    }
+    return (result == kIdle) ? std::min(head, delivered_.load()) : std::min(head, result);
+  }
+
+  bool fits_(uint64_t tail, uint64_t head, uint32_t size) const {
+    const uint64_t used = (tail == head) ? 0 : write_position_ - records_[tail & (records_capacity_ - 1)].position;
+    return (used + size <= bytes_capacity_) && (head - tail < records_capacity_);
+  }
+
+  bool reserve_(uint32_t size, bool is_drop) {
+    const uint64_t head = head_.load(std::memory_order_relaxed);
+    uint64_t tail = tail_.load(std::memory_order_relaxed);
+    if (fits_(tail, head, size)) {
+      return true;
+    }
+
+    uint64_t needed = tail;
+    while (needed < head && !fits_(needed, head, size)) {
+      ++needed;
+    }
+
+    if (!is_drop) {
+      std::unique_lock<std::mutex> lock(space_mutex_);
+      const uint64_t min_cursor = min_cursor_(head);
+      trim_spill_(min_cursor);
+      // what the slowest readers still need goes to disk rather than holding up the input
+      const bool is_spilled = min_cursor < needed && spill_(std::max(tail, min_cursor), needed);
+      while (!stop_ && !is_spilled) {
+        if (min_cursor_(head) >= needed) {
+          break;
+        }
+        space_waiting_ = true;
+        space_condition_.wait_for(lock, std::chrono::milliseconds(100));
+      }
+      if (stop_) {
+        return false;
+      }
+    }
+
+    tail_.store(needed, std::memory_order_seq_cst);
+    const int32_t high = readers_high_.load();
+    for (int32_t i = 0; i < high; ++i) {
+      while (readers_[i].pin.load(std::memory_order_seq_cst) < needed) {
+        std::this_thread::yield();
+      }
+    }
+    return true;
+  }
+
+  // Copy records [begin, end) to the newest segment, opening segments as needed. Producer only. Returns false if
+  // spilling is off or the disk does not take it, the caller then waits for the readers as without spilling.
+  bool spill_(uint64_t begin, uint64_t end) {
+    if (spill_prefix_.empty()) {
+      return false;
+    }
+    for (uint64_t seq = begin; seq < end; ++seq) {
+      const Record &record = records_[seq & (records_capacity_ - 1)];
+      Span spans[2];
+      const int32_t count = this->spans(record.position, record.position + record.length, spans);
+      if (segment_ && segment_->end_seq() == seq && segment_->append(seq, record, spans, count)) {
+        spill_bytes_.fetch_add(record.length, std::memory_order_relaxed);
+        continue;
+      }
+      // full, or the records in between were not needed by anyone
+      auto segment = std::make_shared<Segment>(spill_prefix_ + std::to_string(spill_sequence_++) + ".spill", seq,
+                                               record.position);
+      if (!segment->is_open() || !segment->append(seq, record, spans, count)) {
+        Log::error("Failed to spill to %s, block instead", spill_prefix_.c_str());
+        spill_prefix_.clear();
+        return false;
+      }
+      spill_bytes_.fetch_add(record.length, std::memory_order_relaxed);
+      segment_ = segment;
+      std::lock_guard<std::mutex> lock(spill_mutex_);
+      segments_.push_back(std::move(segment));
+      spill_segments_ = segments_.size();
+    }
+    return true;
+  }
+
+  // Drop the segments every reader is past, the files go away once the last window on them is gone.
+  void trim_spill_(uint64_t min_cursor) {
+    std::lock_guard<std::mutex> lock(spill_mutex_);
+    while (!segments_.empty() && segments_.front()->end_seq() <= min_cursor) {
+      if (segments_.front() == segment_) {
+        segment_.reset();
+      }
+      segments_.pop_front();
+    }
+    spill_segments_ = segments_.size();
+  }
+
+  // First record at or after `seq` still on disk, `tail` if there is none.
+  uint64_t spilled_from_(uint64_t seq, uint64_t tail) const {
+    std::lock_guard<std::mutex> lock(spill_mutex_);
+    for (const auto &segment : segments_) {
+      if (seq < segment->end_seq()) {
+        return std::min(std::max(seq, segment->first_seq()), tail);
+      }
+    }
+    return tail;
+  }
+
+  // oldest record a reader can still get, on disk or in the ring
+  uint64_t spill_tail_() const {
+    const uint64_t tail = tail_.load();
+    return spilled_from_(0, tail);
+  }
+
+  void notify_space_() {
+    if (space_waiting_) {
+      std::lock_guard<std::mutex> lock(space_mutex_);
+      space_waiting_ = false;
+      space_condition_.notify_all();
+    }
+  }
+
+ private:
+  const uint64_t bytes_capacity_;
+  const uint64_t records_capacity_;
+  std::unique_ptr<char[]> bytes_;
+  std::unique_ptr<Record[]> records_;
+  std::unique_ptr<Reader[]> readers_;
+  std::atomic<int32_t> readers_high_{0};
+
+  // producer private
+  uint64_t write_position_{0};
+
+  std::atomic<uint64_t> head_{0};
+  std::atomic<uint64_t> tail_{0};
+  std::atomic<uint64_t> delivered_{0};
+  std::atomic<uint64_t> written_{0};
+
+  const int32_t waiter_count_;
+  std::unique_ptr<Waiter[]> waiters_;
+
+  // spilling, the producer appends to segment_, readers find theirs in segments_ under spill_mutex_
+  std::string spill_prefix_{""};
+  uint64_t spill_sequence_{0};
+  std::shared_ptr<Segment> segment_;
+  std::deque<std::shared_ptr<const Segment>> segments_;
+  mutable std::mutex spill_mutex_;
+  std::atomic<uint64_t> spill_bytes_{0};
+  std::atomic<uint64_t> spill_segments_{0};
+
+  std::atomic<bool> stop_{false};
+  std::atomic<bool> space_waiting_{false};
+  std::mutex space_mutex_;
+  std::condition_variable space_condition_;
+};
+
+#endif  // CHANNEL_RING_H
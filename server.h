@@ -2,28 +2,143 @@
 #define CHANNEL_SERVER_H
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/epoll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-#include <condition_variable>
+#include <algorithm>
+#include <atomic>
 #include <fstream>
 #include <iostream>
-#include <list>
+#include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
-#include <unordered_set>
+#include <unordered_map>
+#include <vector>
 
+#include "client.h"
 #include "config.h"
+#include "filter.h"
 #include "log.h"
+#include "lz.h"
+#include "ring.h"
+#include "shm.h"
+#include "stats.h"
+#include "uring.h"
 #include "utils.h"
 
+// What to do with a client whose unsent backlog grows past ServerOptions::max_lag bytes.
+enum class LagPolicy {
+  kDrop,        // skip the client's oldest data
+  kDisconnect,  // close the connection
+};
+
+// How frames are cut from the ring and grouped into sends. With a linger time a client's batch is held while it is
+// smaller than what the measured input rate would bring in over that time, so fast producers get large sends and
+// slow ones at most linger_us of extra latency.
+struct BatchOptions {
+  // payload bytes per frame, at most kMaxFrameLength. Clients of the v1 wire format get kMaxMessageLength at most.
+  uint32_t max_bytes{kDefaultBatchBytes};
+  // frames per sendmsg, at most kMaxBatchFrames
+  uint32_t max_frames{kDefaultBatchFrames};
+  // 0 sends whatever is there at once
+  int64_t linger_us{kDefaultLingerUs};
+};
+
+// A named input stream of the server, clients subscribe to it by name.
+struct ChannelOptions {
+  std::string name{kDefaultChannel};
+  // file or FIFO to read, "-" for stdin
+  std::string path{"-"};
+};
+
+struct ServerOptions {
+  uint16_t port{kDefaultPort};
+  // 0 disables the per client lag limit
+  uint64_t max_lag{kDefaultMaxClientLag};
+  LagPolicy lag_policy{LagPolicy::kDrop};
+  // read stdin in large chunks cut at the last newline instead of line by line
+  bool is_bulk{false};
+  // print what is read from stdin
+  bool is_echo{true};
+  // bytes of sent data retained for replay on connect
+  uint64_t history_size{kMaxHistorySize};
+  // dump stats as JSON lines to stderr this often, 0 for only on SIGUSR1
+  int64_t stats_interval_ms{0};
+  BatchOptions batch;
+  // sender threads, each serving its share of the clients
+  int32_t senders{1};
+  // each with its own queue and history, the first one is what clients get without asking
+  std::vector<ChannelOptions> channels{ChannelOptions()};
+  // without drop, spill what slow clients still need to segment files in this directory instead of blocking the
+  // input, empty to block
+  std::string spill_dir{""};
+  // read the channels from another server instead of their paths, frames are passed on whole with their original
+  // timestamps and one more hop
+  bool is_relay{false};
+  ClientOptions upstream;
+  // "group:port" to also send every channel once to a multicast group, empty for TCP only
+  std::string multicast{""};
+  // accept and send through io_uring when the kernel has it, epoll and a system call per send otherwise
+  bool is_uring{false};
+  // name of a shared memory object to also publish every channel to, for clients on this host, empty for none
+  std::string shm{""};
+};
+
 class Server {
+ private:
+  struct Channel;
+
  public:
-  Server(uint16_t port) {
-    port_ = port;
+  Server(const ServerOptions &options)
+      : options_(options),
+        max_frame_bytes_(std::max(options.batch.max_bytes, kMaxMessageLength)),
+        stats_("server", options.stats_interval_ms) {
+    if (options_.batch.max_bytes == 0 || options_.batch.max_bytes > kMaxFrameLength) {
+      throw "Invalid batch bytes\n";
+    }
+    if (options_.batch.max_frames == 0 || options_.batch.max_frames > kMaxBatchFrames) {
+      throw "Invalid batch frames\n";
+    }
+    if (options_.senders <= 0 || options_.senders > kMaxSenders) {
+      throw "Invalid sender count\n";
+    }
+    if (options_.channels.empty() || options_.channels.size() > kMaxChannels) {
+      throw "Invalid channel count\n";
+    }
+    for (const ChannelOptions &channel : options_.channels) {
+      if (channel.name.empty() || channel.name.find_first_of(",=\n") != std::string::npos) {
+        throw "Invalid channel name\n";
+      }
+      if (find_channel_(channel.name) != nullptr) {
+        throw "Duplicate channel name\n";
+      }
+      if (channel.path == "-" && std::any_of(channels_.begin(), channels_.end(),
+                                             [](const auto &other) { return other->path == "-"; })) {
+        throw "Only one channel can read stdin\n";
+      }
+      // room for lines averaging 64 bytes before the record table rather than the bytes run out
+      const uint64_t capacity = kMaxMessageQueueSize * kMaxMessageSize + options_.history_size;
+      // the multicast and shared memory writers wait on the rings like more senders
+      const int32_t waiters =
+          options_.senders + (options_.multicast.empty() ? 0 : 1) + (options_.shm.empty() ? 0 : 1);
+      channels_.push_back(std::make_unique<Channel>(channels_.size(), channel, capacity, waiters));
+      if (!options_.spill_dir.empty()) {
+        channels_.back()->ring.enable_spill(options_.spill_dir + "/" + channel.name + "-" + std::to_string(getpid()) +
+                                            "-");
+      }
+    }
+    port_ = options_.port;
     server_socket_ = socket(AF_INET, SOCK_STREAM, 0);
     close(server_socket_);
 
@@ -48,201 +163,1942 @@ class Server {
       throw "Failed to listen on server socket\n";
     }
 
+    if (!options_.multicast.empty()) {
+      open_multicast_();
+    }
+    if (!options_.shm.empty()) {
+      std::vector<std::string> names;
+      for (const auto &channel : channels_) {
+        names.push_back(channel->name);
+      }
+      if (Shm::is_in_use(options_.shm)) {
+        throw "Shared memory of that name is in use by another server\n";
+      }
+      shm_ = Shm::create(options_.shm, names, kShmChannelBytes);
+      if (!shm_) {
+        throw "Failed to create shared memory\n";
+      }
+    }
+
+    for (int32_t i = 0; i < options_.senders; ++i) {
+      std::unique_ptr<Sender> sender = std::make_unique<Sender>();
+      sender->index = i;
+      sender->compressed.resize(options_.batch.max_frames);
+      sender->indexes.resize(options_.batch.max_frames);
+      sender->checksums.resize(options_.batch.max_frames);
+      sender->epoll_fd = epoll_create1(0);
+      if (sender->epoll_fd < 0) {
+        throw "Failed to create epoll\n";
+      }
+
+      if (options_.is_uring) {
+        sender->uring = Uring::create(kUringEntries);
+        if (!sender->uring && i == 0) {
+          Log::info("io_uring is not available, using epoll");
+        }
+      }
+
+      sender->rates.resize(channels_.size());
+      for (const auto &channel : channels_) {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = nullptr;
+        if (epoll_ctl(sender->epoll_fd, EPOLL_CTL_ADD, channel->ring.event_fd(i), &event) < 0) {
+          throw "Failed to add ring to epoll\n";
+        }
+      }
+      senders_.push_back(std::move(sender));
+    }
+
+    stats_.add("send_bytes", &send_bytes_);
+    stats_.add("frames", &frames_);
+    stats_.add("clients", &client_count_);
+    stats_.add("drop_records", &drop_records_);
+    stats_.add("lag_drop_bytes", &lag_drops_);
+    stats_.add("lag_disconnects", &lag_disconnects_);
+    stats_.add("filter_drop_bytes", &filter_drops_);
+    stats_.add(&send_delay_us_hist_);
+    stats_.add(&queue_depth_hist_);
+    stats_.add(&batch_records_hist_);
+    stats_.add(&batch_bytes_hist_);
+    stats_.add(&batch_frames_hist_);
+    stats_.add(&linger_us_hist_);
+    stats_.add("batch_target_bytes", &target_bytes_);
+    if (!options_.multicast.empty()) {
+      stats_.add("multicast_bytes", &multicast_bytes_);
+      stats_.add("multicast_datagrams", &multicast_datagrams_);
+      stats_.add("multicast_errors", &multicast_errors_);
+    }
+    if (shm_) {
+      stats_.add("shm_records", &shm_records_);
+    }
+    if (!options_.spill_dir.empty()) {
+      for (const auto &channel : channels_) {
+        stats_.add(channel->name + ".spill_bytes", &channel->ring.spill_bytes());
+        stats_.add(channel->name + ".spill_segments", &channel->ring.spill_segments());
+      }
+    }
+    stats_.start();
+
     process_();
   }
 
   ~Server() {
     stop_ = true;
-    messages_condition_.notify_all();
-    clients_condition_.notify_all();
+    for (auto &channel : channels_) {
+      channel->ring.stop();
+    }
 
     if (client_thread_.joinable()) {
       client_thread_.join();
     }
+    if (multicast_thread_.joinable()) {
+      multicast_thread_.join();
+    }
+    if (multicast_socket_ >= 0) {
+      close(multicast_socket_);
+    }
+    if (shm_thread_.joinable()) {
+      shm_thread_.join();
+    }
+    shm_.reset();
+    for (auto &sender : senders_) {
+      if (sender->thread.joinable()) {
+        sender->thread.join();
+      }
+    }
     {
       std::lock_guard<std::mutex> lock(clients_mutex_);
-      for (int32_t client_socket : client_sockets_) {
+      for (const auto &[client_socket, peer] : clients_) {
+        unsubscribe_(peer.get());
         close(client_socket);
       }
+      clients_.clear();
     }
     Log::debug("Client stopped");
 
-    if (server_thread_.joinable()) {
-      server_thread_.join();
+    for (auto &sender : senders_) {
+      close(sender->epoll_fd);
     }
     close(server_socket_);
-    Log::debug("Server stopped");
+    Log::debug("Server stopped, lag drops: %lu bytes, lag disconnects: %lu", lag_drops_.load(),
+               lag_disconnects_.load());
   }
 
+  // Feed every channel from its input until all of them ended.
   void send_message(bool is_drop) {
+    if (options_.is_relay) {
+      relay_(is_drop);
+    } else {
+      for (auto &channel : channels_) {
+        channel->reader = std::thread([this, channel = channel.get(), is_drop]() { read_(channel, is_drop); });
+      }
+      for (auto &channel : channels_) {
+        channel->reader.join();
+      }
+    }
+    drain();
+  }
+
+  class Producer;
+
+  // In-process input for an application that embeds the server rather than piping into `channel -s`. nullptr if
+  // there is no channel of that name.
+  std::unique_ptr<Producer> producer(const std::string &channel = kDefaultChannel, bool is_drop = true) {
+    Channel *found = find_channel_(channel);
+    return (found == nullptr) ? nullptr : std::unique_ptr<Producer>(new Producer(found, is_drop));
+  }
+
+  // Block until every client got what was written so far.
+  void drain() {
+    Log::debug("Waiting for sender to stop");
+    for (auto &channel : channels_) {
+      channel->ring.wait_drained();
+    }
+    Log::debug("Sender stopped");
+  }
+
+  // Writes records into one channel from the application's threads, one producer per thread and any number of them
+  // per channel, they take turns on the channel's ring. Nothing is allocated once it is created, it must not outlive
+  // the server.
+  class Producer {
+   public:
+    Producer(const Producer &) = delete;
+    Producer &operator=(const Producer &) = delete;
+
+    // Append `size` bytes as one record, or as several past kMaxMessageLength. Returns false once the server
+    // stopped.
+    bool publish(const char *data, size_t size) { return publish(data, size, Message::timestamp_us()); }
+
+    // The same with when the data came about, and what a relay knows of its way here.
+    bool publish(const char *data, size_t size, int64_t generate_timestamp, uint32_t hops = 0,
+                 int64_t relay_timestamp = 0) {
+      std::lock_guard<std::mutex> lock(channel_->write_mutex);
+      for (size_t offset = 0; offset < size; offset += kMaxMessageLength) {
+        const uint32_t length = std::min<size_t>(kMaxMessageLength, size - offset);
+        if (!channel_->ring.write(data + offset, length, generate_timestamp, is_drop_, hops, relay_timestamp)) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // Room to format one record of up to `size` bytes in place, in the ring itself unless it would wrap around
+    // there. The channel's other producers wait until commit() stores the first `length` bytes. nullptr if `size`
+    // is larger than kMaxMessageLength.
+    char *reserve(uint32_t size) {
+      if (size > kMaxMessageLength) {
+        return nullptr;
+      }
+      lock_ = std::unique_lock<std::mutex>(channel_->write_mutex);
+      reserved_ = channel_->ring.reserve(size, is_drop_);
+      return (reserved_ != nullptr) ? reserved_ : scratch_.get();
+    }
+
+    // Returns false once the server stopped.
+    bool commit(uint32_t length) {
+      bool is_written = true;
+      if (length == 0) {
+        // nothing to store
+      } else if (reserved_ != nullptr) {
+        channel_->ring.commit(length, Message::timestamp_us());
+      } else {
+        is_written = channel_->ring.write(scratch_.get(), length, Message::timestamp_us(), is_drop_);
+      }
+      reserved_ = nullptr;
+      lock_.unlock();
+      return is_written;
+    }
+
+   private:
+    friend class Server;
+
+    Producer(Channel *channel, bool is_drop)
+        : channel_(channel), is_drop_(is_drop), scratch_(std::make_unique<char[]>(kMaxMessageLength)) {}
+
+    Channel *const channel_;
+    const bool is_drop_;
+    // a reservation that would wrap around the ring is formatted here and copied
+    std::unique_ptr<char[]> scratch_;
+    char *reserved_{nullptr};
+    std::unique_lock<std::mutex> lock_;
+  };
+
+ private:
+  // One named input with its own ring, read by a thread of its own and served by every sender.
+  struct Channel {
+    Channel(uint32_t id, const ChannelOptions &options, uint64_t capacity, int32_t waiters)
+        : id(id), name(options.name), path(options.path), ring(capacity, capacity / 64, waiters) {}
+
+    const uint32_t id;
+    const std::string name;
+    const std::string path;
+    Ring ring;
+    std::thread reader;
+    // the ring takes one producer at a time
+    std::mutex write_mutex;
+  };
+
+  // A client's position in one channel.
+  struct Subscription {
+    Channel *channel{nullptr};
+    int32_t reader{-1};
+    // next record to send
+    uint64_t cursor{0};
+    // where a client that asked for a range is done, see "count" in hello_
+    uint64_t end{Ring::kIdle};
+    // set while a small batch waits for more data
+    int64_t linger_since{0};
+    int64_t linger_deadline{0};
+  };
+
+  struct Transfer;
+
+  // Per client state, owned by one sender thread once accepted.
+  struct Peer {
+    int32_t socket{-1};
+    // index of the owning sender, only changed under clients_mutex_
+    int32_t sender{0};
+    std::string address{""};
+    // the default channel until the hello names others
+    std::vector<Subscription> subscriptions;
+    // subscription to serve next, they take turns
+    size_t next_subscription{0};
+    // subscribed by name, every frame carries its channel id in MessageExt
+    bool is_multiplexed{false};
+    // tail of a frame the socket did not take at once
+    std::string pending{""};
+    size_t pending_offset{0};
+    bool is_writable{false};
+    uint64_t drop_records{0};
+    uint64_t drop_bytes{0};
+    // nothing is sent until the client's hello arrived or the deadline passed, old clients never send one
+    bool is_greeting{true};
+    int64_t greeting_deadline{0};
+    // requests from the client, allocated once it sends anything
+    std::unique_ptr<Receiver> receiver;
+    bool is_compress{false};
+    // understands MessageRelay after MessageExt
+    bool is_hops{false};
+    // reads the v2 wire format, frames may carry up to kMaxFrameLength bytes
+    bool is_v2{false};
+    // wants a CRC-32C of every data frame's payload, v2 only
+    bool is_checksum{false};
+    // wants the length and generate_timestamp of every record of a frame, v2 only and not with a filter
+    bool is_index{false};
+    // wants every extension up to MessageRange, to see how many records each frame covers
+    bool is_range{false};
+    // only matching lines are sent, shared with every client that asked for the same filter
+    std::shared_ptr<const Filter> filter;
+    bool is_closed{false};
+    // the send in flight on the sender's io_uring, allocated on the first one
+    std::unique_ptr<Transfer> transfer;
+  };
+
+  // header, record index and a payload that may wrap around the ring
+  inline static const int32_t kMaxFrameIovecs = 4;
+
+  // A frame as described once and its header as encoded for one client, in its wire version and with the fields it
+  // asked for, so it goes out as one iovec entry.
+  struct FrameHeader {
+    Frame frame;
+    char bytes[kMaxFrameHeaderSize];
+  };
+
+  // One sendmsg of a batch, or of a peer's pending bytes, kept until the socket took it. The iovecs point into the
+  // headers, the window or the pending bytes, and the subscription stays pinned at `begin` meanwhile.
+  struct Transfer {
+    // nullptr for pending bytes
+    Subscription *subscription{nullptr};
+    Ring::Window window;
+    uint64_t begin{0};
+    uint64_t end{0};
+    uint64_t head{0};
+    uint32_t frames{0};
+    FrameHeader headers[kMaxBatchFrames];
+    struct iovec iov[kMaxFrameIovecs * kMaxBatchFrames];
+    int32_t iov_count{0};
+    struct msghdr msg = {};
+  };
+
+  // Compressed payload of the last batch, shared by every client asking for the same records. The buffers are
+  // allocated on first use, max_frame_bytes_ each.
+  struct Compressed {
+    const Channel *channel{nullptr};
+    // Filter::id of the payload, 0 for the records as they are
+    uint64_t filter{0};
+    uint64_t begin{Ring::kIdle};
+    uint64_t end{Ring::kIdle};
+    std::unique_ptr<char[]> data;
+    // linear copy of a batch that wraps around the ring
+    std::unique_ptr<char[]> scratch;
+    size_t size{0};
+  };
+
+  // Matching lines of the last batch, shared by every client of a sender using the same filter.
+  struct Filtered {
+    const Channel *channel{nullptr};
+    uint64_t begin{Ring::kIdle};
+    uint64_t end{Ring::kIdle};
+    std::unique_ptr<char[]> data;
+    // linear copy of a batch that wraps around the ring, a line may straddle the wrap
+    std::unique_ptr<char[]> scratch;
+    size_t size{0};
+  };
+
+  // Record index of the last batch, see encode_index.
+  struct Index {
+    const Channel *channel{nullptr};
+    uint64_t begin{Ring::kIdle};
+    uint64_t end{Ring::kIdle};
+    std::vector<IndexEntry> entries;
+    std::string data;
+  };
+
+  // CRC-32C of the payload of the last batch, whichever of the above it is.
+  struct Checksum {
+    const Channel *channel{nullptr};
+    uint64_t filter{0};
+    // kFlagCompressed and kFlagIndex as the payload has them
+    uint32_t flags{0};
+    uint64_t begin{Ring::kIdle};
+    uint64_t end{Ring::kIdle};
+    uint32_t value{0};
+  };
+
+  // Input rate of one channel as seen by one sender, in bytes per µs and smoothed over kRateWindowUs windows.
+  struct Rate {
+    double rate{0};
+    int64_t timestamp{0};
+    uint64_t written{0};
+    uint64_t target_bytes{0};
+  };
+
+  // One sender thread with its own epoll and its share of the clients. All senders read the same rings, the
+  // producers wake each one through its own eventfd.
+  struct Sender {
+    int32_t index{0};
+    int32_t epoll_fd{-1};
+    std::thread thread;
+    // the clients assigned to this sender changed, its peer list has to be rebuilt
+    std::atomic<bool> is_changed{false};
+    std::atomic<uint32_t> client_count{0};
+    Lz lz;
+    // one per frame slot of a send
+    std::vector<Compressed> compressed;
+    std::vector<Index> indexes;
+    std::vector<Checksum> checksums;
+    // one per channel
+    std::vector<Rate> rates;
+    // by Filter::id, one per frame slot of a send
+    std::unordered_map<uint64_t, std::vector<Filtered>> filtered;
+    // sends of a pass go out in one submission, nullptr for one sendmsg each
+    std::unique_ptr<Uring> uring;
+    uint32_t in_flight{0};
+    // peers whose send failed on completion, disconnected after the pass
+    std::vector<Peer *> failed;
+    // the one send at a time without io_uring
+    Transfer transfer;
+  };
+
+  Channel *find_channel_(const std::string &name) const {
+    for (const auto &channel : channels_) {
+      if (channel->name == name) {
+        return channel.get();
+      }
+    }
+    return nullptr;
+  }
+
+  // Feed the channels from the upstream server, every record of its frames becomes one record here with its own
+  // generate_timestamp, without splitting it into lines again. A frame of an upstream that sends no record index is
+  // one record, or several cut after a newline where it is larger than a record can be.
+  void relay_(bool is_drop) {
+    ClientOptions options = options_.upstream;
+    // a lone default channel takes whatever upstream serves by default
+    if (channels_.size() > 1 || channels_.front()->name != kDefaultChannel) {
+      for (const auto &channel : channels_) {
+        options.channels.push_back(channel->name);
+      }
+    }
+    std::vector<std::unique_ptr<Producer>> producers;
+    for (const auto &channel : channels_) {
+      producers.push_back(producer(channel->name, is_drop));
+    }
+    try {
+      Client client(options);
+      client.relay([&](const RelayFrame &frame) {
+        Channel *channel = (channels_.size() == 1) ? channels_.front().get() : find_channel_(*frame.channel);
+        if (channel == nullptr || frame.size == 0) {
+          return true;
+        }
+        if (options_.is_echo) {
+          write_all(STDOUT_FILENO, frame.data, frame.size);
+        }
+        const int64_t relay_timestamp = Message::timestamp_us();
+        for (size_t offset = 0; offset < frame.size;) {
+          size_t length = std::min<size_t>(kMaxMessageLength, frame.size - offset);
+          if (offset + length < frame.size) {
+            const char *cut = static_cast<const char *>(memrchr(frame.data + offset, '\n', length));
+            length = (cut != nullptr) ? cut - (frame.data + offset) + 1 : length;
+          }
+          if (!producers[channel->id]->publish(frame.data + offset, length, frame.generate_timestamp,
+                                               frame.hops + 1, relay_timestamp)) {
+            return false;
+          }
+          offset += length;
+        }
+        return true;
+      });
+    } catch (const char *message) {
+      Log::raw("%s", message);
+    }
+    Log::debug("Upstream %s:%u ended", options.ip.c_str(), options.port);
+  }
+
+  // The command line's input: a channel's file or stdin through a producer of its own.
+  void read_(Channel *channel, bool is_drop) {
+    Producer producer(channel, is_drop);
+    const bool is_stdin = (channel->path == "-");
+    if (options_.is_bulk) {
+      const int32_t fd = is_stdin ? STDIN_FILENO : open(channel->path.c_str(), O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        Log::error("Failed to open %s for channel %s", channel->path.c_str(), channel->name.c_str());
+        return;
+      }
+      read_chunks_(&producer, fd);
+      if (!is_stdin) {
+        close(fd);
+      }
+    } else if (is_stdin) {
+      read_lines_(&producer, std::cin);
+    } else {
+      std::ifstream input(channel->path);
+      if (!input) {
+        Log::error("Failed to open %s for channel %s", channel->path.c_str(), channel->name.c_str());
+        return;
+      }
+      read_lines_(&producer, input);
+    }
+    Log::debug("Channel %s input ended", channel->name.c_str());
+  }
+
+  void read_lines_(Producer *producer, std::istream &bstream) {
     std::string message = "";
-    auto &bstream = std::cin;
     while (std::getline(bstream, message) && !stop_) {
       if (!message.empty()) {
         message += "\n";
         Log::debug("Message %lu Bytes", message.size());
-        Log::raw("%s", message.c_str());
-        Message msg;
-        msg.body.length = message.size();
-        msg.body.generate_timestamp = Message::timestamp_us();
-        message = std::string(reinterpret_cast<char *>(&msg), sizeof(Message)) + message;
-        send_message_(message, is_drop);
+        if (options_.is_echo) {
+          write_all(STDOUT_FILENO, message.data(), message.size());
+        }
+        producer->publish(message.data(), message.size());
       }
     }
+  }
 
-    Log::debug("Waiting for sender to stop");
-    {
-      std::unique_lock<std::mutex> lock(messages_mutex_);
-      messages_condition_.wait(lock, [this] { return messages_.empty() || stop_; });
+  // Pull whatever stdin has with read() and forward it up to the last newline as one record, the partial line
+  // stays in the buffer for the next round.
+  void read_chunks_(Producer *producer, int32_t fd) {
+    // one spare byte to terminate a last line without newline
+    std::unique_ptr<char[]> buffer = std::make_unique<char[]>(kMaxMessageLength + 1);
+    size_t size = 0;
+    while (!stop_) {
+      const ssize_t length = read(fd, buffer.get() + size, kMaxMessageLength - size);
+      if (length < 0 && errno == EINTR) {
+        continue;
+      }
+      if (length <= 0) {
+        break;
+      }
+      size += length;
+
+      const char *last = static_cast<const char *>(memrchr(buffer.get(), '\n', size));
+      // a line longer than the buffer goes out in pieces
+      const size_t cut = (last != nullptr) ? (last - buffer.get() + 1) : ((size == kMaxMessageLength) ? size : 0);
+      if (cut == 0) {
+        continue;
+      }
+      Log::debug("Message %lu Bytes", cut);
+      if (options_.is_echo) {
+        write_all(STDOUT_FILENO, buffer.get(), cut);
+      }
+      if (!producer->publish(buffer.get(), cut)) {
+        return;
+      }
+      size -= cut;
+      memmove(buffer.get(), buffer.get() + cut, size);
+    }
+
+    if (size > 0) {
+      buffer[size++] = '\n';
+      if (options_.is_echo) {
+        write_all(STDOUT_FILENO, buffer.get(), size);
+      }
+      producer->publish(buffer.get(), size);
     }
-    Log::debug("Sender stopped");
   }
 
- private:
-  void send_message_(const std::string &message, bool is_drop = true) {
+  // Coalesce records [begin, limit) into one frame of at most `max_bytes`, counting `overhead` more for each record.
+  // Returns the end of the frame, `length` is the payload without the overhead.
+  static uint64_t coalesce_(const Ring::Window &window, uint64_t begin, uint64_t limit, uint64_t max_bytes,
+                            uint32_t overhead, uint64_t *length) {
+    uint64_t end = begin;
+    *length = 0;
+    while (end < limit) {
+      const uint32_t record_length = window.record(end).length;
+      // a record larger than max_bytes still goes out, alone
+      if (end > begin && *length + record_length + (end - begin + 1) * overhead > max_bytes) {
+        break;
+      }
+      *length += record_length;
+      ++end;
+    }
+    return end;
+  }
+
+  // Describe records [begin, end) of a channel's `window` as frame `slot` of a send: the header lives in `header`,
+  // the payload is referenced in place or, for clients that asked for it, points at the shared filtered or
+  // compressed copy behind the shared record index. Returns the number of iovec entries used, at most
+  // kMaxFrameIovecs, 0 if the filter left nothing to send.
+  int32_t frame_(Sender *sender, const Peer *peer, const Channel *channel, const Ring::Window &window, uint32_t slot,
+                 uint64_t begin, uint64_t end, uint64_t length, FrameHeader *header, struct iovec *iov) {
+    const Ring::Record &first = window.record(begin);
+    const Ring::Record &last = window.record(end - 1);
+    describe_(header, channel, window, begin, end, length);
+    Frame *frame = &header->frame;
+    frame->version = peer->is_v2 ? kVersion2.version : kVersion.version;
+    frame->fields = peer->is_multiplexed ? kFieldsChannel : kFieldsBasic;
+    if (peer->is_hops && first.hops > 0) {
+      frame->fields = kFieldsRelay;
+    }
+    if (peer->is_range) {
+      frame->fields = kFieldsRange;
+    }
+    iov[0].iov_base = header->bytes;
+    Ring::Span spans[2];
+    int32_t count = window.spans(first.position, last.position + last.length, spans);
+    uint64_t filter = 0;
+    if (peer->filter) {
+      // send_bytes and index keep counting the whole stream, only the payload shrinks
+      const Filtered &filtered = filter_(sender, peer->filter.get(), channel, slot, begin, end, spans, count);
+      filter_drops_.fetch_add(length - filtered.size, std::memory_order_relaxed);
+      if (filtered.size == 0) {
+        return 0;
+      }
+      filter = peer->filter->id();
+      length = filtered.size;
+      frame->length = length;
+      spans[0] = {filtered.data.get(), filtered.size};
+      count = 1;
+    }
+    const bool is_compressed =
+        peer->is_compress && compress_(sender, &sender->compressed[slot], channel, filter, begin, end, spans, count);
+    if (is_compressed) {
+      const Compressed &compressed = sender->compressed[slot];
+      frame->fields = std::max(frame->fields, kFieldsChannel);
+      frame->length = compressed.size;
+      frame->flags = kFlagCompressed;
+      frame->raw_length = length;
+      spans[0] = {compressed.data.get(), compressed.size};
+      count = 1;
+    }
+    // lines a filter dropped are no longer where the index says
+    Ring::Span payload[3];
+    int32_t parts = 0;
+    if (peer->is_index && !peer->filter) {
+      const std::string &index = index_(sender, &sender->indexes[slot], channel, window, begin, end);
+      frame->flags |= kFlagIndex;
+      frame->length += index.size();
+      payload[parts++] = {index.data(), index.size()};
+    }
+    for (int32_t i = 0; i < count; ++i) {
+      payload[parts++] = spans[i];
+    }
+    if (peer->is_checksum) {
+      frame->checksum = checksum_(&sender->checksums[slot], channel, filter, frame->flags, begin, end, payload, parts);
+      frame->flags |= kFlagChecksum;
+    }
+    iov[0].iov_len = encode_frame(*frame, header->bytes);
+    for (int32_t i = 0; i < parts; ++i) {
+      iov[i + 1].iov_base = const_cast<char *>(payload[i].data);
+      iov[i + 1].iov_len = payload[i].size;
+    }
+    return parts + 1;
+  }
+
+  // Lengths and timestamps of records [begin, end) once for every client of the sender that wants them, per frame
+  // slot like the compressed copies.
+  const std::string &index_(Sender *sender, Index *index, const Channel *channel, const Ring::Window &window,
+                            uint64_t begin, uint64_t end) {
+    if (index->channel == channel && index->begin == begin && index->end == end) {
+      return index->data;
+    }
+    if (sender->in_flight > 0) {
+      complete_all_(sender);
+    }
+    index->channel = channel;
+    index->begin = begin;
+    index->end = end;
+    index->entries.resize(end - begin);
+    for (uint64_t seq = begin; seq < end; ++seq) {
+      const Ring::Record &record = window.record(seq);
+      index->entries[seq - begin] = {record.length, record.generate_timestamp};
+    }
+    index->data.clear();
+    encode_index(&index->data, index->entries.data(), index->entries.size(), window.record(begin).generate_timestamp);
+    return index->data;
+  }
+
+  // CRC-32C of a frame's payload once for every client of the sender that wants it, per frame slot like the
+  // compressed and filtered copies the payload may be.
+  static uint32_t checksum_(Checksum *checksum, const Channel *channel, uint64_t filter, uint32_t flags,
+                            uint64_t begin, uint64_t end, const Ring::Span *spans, int32_t count) {
+    if (checksum->channel != channel || checksum->filter != filter || checksum->flags != flags ||
+        checksum->begin != begin || checksum->end != end) {
+      checksum->channel = channel;
+      checksum->filter = filter;
+      checksum->flags = flags;
+      checksum->begin = begin;
+      checksum->end = end;
+      checksum->value = 0;
+      for (int32_t i = 0; i < count; ++i) {
+        checksum->value = crc32c(checksum->value, spans[i].data, spans[i].size);
+      }
+    }
+    return checksum->value;
+  }
+
+  // Fill in every header field of a frame of records [begin, end), the caller decides how much of it is sent.
+  static void describe_(FrameHeader *header, const Channel *channel, const Ring::Window &window, uint64_t begin,
+                        uint64_t end, uint64_t length) {
+    const Ring::Record &first = window.record(begin);
+    const Ring::Record &last = window.record(end - 1);
+    Frame *frame = &header->frame;
+    frame->generate_timestamp = first.generate_timestamp;
+    frame->index = begin;
+    // bytes the records would take as one Message each, a monotonic position in the channel's stream
+    frame->send_bytes = last.position + last.length + sizeof(Message) * end;
+    frame->length = length;
+    frame->send_timestamp = Message::timestamp_us() - frame->generate_timestamp;
+    frame->flags = 0;
+    frame->raw_length = 0;
+    frame->channel = channel->id;
+    frame->checksum = 0;
+    frame->hops = first.hops;
+    frame->relay_timestamp = first.relay_timestamp;
+    frame->records = end - begin;
+  }
+
+  // Compress a frame once for every client of the sender that wants it, each frame slot of a send has its own cache
+  // entry. Returns false when it does not pay off, the frame then goes out as a plain Message.
+  bool compress_(Sender *sender, Compressed *compressed, const Channel *channel, uint64_t filter, uint64_t begin,
+                 uint64_t end, const Ring::Span spans[2], int32_t count) {
+    if (compressed->channel == channel && compressed->filter == filter && compressed->begin == begin &&
+        compressed->end == end) {
+      return compressed->size > 0;
+    }
+    // queued sends may still point at the entry
+    if (sender->in_flight > 0) {
+      complete_all_(sender);
+    }
+    compressed->channel = channel;
+    compressed->filter = filter;
+    compressed->begin = begin;
+    compressed->end = end;
+    if (!compressed->data) {
+      compressed->data = std::make_unique<char[]>(max_frame_bytes_);
+      compressed->scratch = std::make_unique<char[]>(max_frame_bytes_);
+    }
+
+    const char *data = spans[0].data;
+    size_t size = spans[0].size;
+    if (count == 2) {
+      memcpy(compressed->scratch.get(), spans[0].data, spans[0].size);
+      memcpy(compressed->scratch.get() + spans[0].size, spans[1].data, spans[1].size);
+      data = compressed->scratch.get();
+      size += spans[1].size;
+    }
+    // must at least win back the extension header
+    const size_t capacity = (size > sizeof(MessageExt)) ? size - sizeof(MessageExt) : 0;
+    compressed->size = sender->lz.compress(data, size, compressed->data.get(), capacity);
+    Log::debug("Compress %lu Bytes to %lu", size, compressed->size);
+    return compressed->size > 0;
+  }
+
+  // Run a filter over records [begin, end) once for every client of the sender using it, each frame slot of a send
+  // has its own cache entry.
+  const Filtered &filter_(Sender *sender, const Filter *filter, const Channel *channel, uint32_t slot, uint64_t begin,
+                          uint64_t end, const Ring::Span spans[2], int32_t count) {
+    std::vector<Filtered> &cache = sender->filtered[filter->id()];
+    if (cache.empty()) {
+      cache.resize(options_.batch.max_frames);
+    }
+    Filtered &filtered = cache[slot];
+    if (filtered.channel == channel && filtered.begin == begin && filtered.end == end) {
+      return filtered;
+    }
+    if (sender->in_flight > 0) {
+      complete_all_(sender);
+    }
+    filtered.channel = channel;
+    filtered.begin = begin;
+    filtered.end = end;
+    if (!filtered.data) {
+      filtered.data = std::make_unique<char[]>(max_frame_bytes_);
+      filtered.scratch = std::make_unique<char[]>(max_frame_bytes_);
+    }
+
+    const char *data = spans[0].data;
+    size_t size = spans[0].size;
+    if (count == 2) {
+      memcpy(filtered.scratch.get(), spans[0].data, spans[0].size);
+      memcpy(filtered.scratch.get() + spans[0].size, spans[1].data, spans[1].size);
+      data = filtered.scratch.get();
+      size += spans[1].size;
+    }
+    filtered.size = (count == 0) ? 0 : filter->apply(data, size, filtered.data.get());
+    return filtered;
+  }
+
+  // Compile a filter spec or share the instance clients already use. Returns nullptr for an invalid spec.
+  std::shared_ptr<const Filter> compile_filter_(const std::string &spec) {
+    std::lock_guard<std::mutex> lock(filters_mutex_);
+    auto it = filters_.find(spec);
+    if (it != filters_.end()) {
+      std::shared_ptr<const Filter> filter = it->second.lock();
+      if (filter) {
+        return filter;
+      }
+    }
+    std::shared_ptr<const Filter> filter = Filter::compile(spec, ++filter_ids_);
+    if (!filter) {
+      return nullptr;
+    }
+    for (auto entry = filters_.begin(); entry != filters_.end();) {
+      entry = entry->second.expired() ? filters_.erase(entry) : std::next(entry);
+    }
+    filters_[spec] = filter;
+    return filter;
+  }
+
+  // Follow each channel's input rate and derive how many bytes are worth waiting for within the linger time.
+  void measure_rate_(Sender *sender) {
+    const int64_t now = Message::timestamp_us();
+    uint64_t target_bytes = 0;
+    for (const auto &channel : channels_) {
+      Rate &rate = sender->rates[channel->id];
+      if (now - rate.timestamp >= kRateWindowUs) {
+        const uint64_t written = channel->ring.written();
+        const double current = static_cast<double>(written - rate.written) / static_cast<double>(now - rate.timestamp);
+        rate.rate += (current - rate.rate) / 8;
+        rate.timestamp = now;
+        rate.written = written;
+        const double limit = static_cast<double>(options_.batch.max_bytes) * options_.batch.max_frames;
+        rate.target_bytes = std::min(limit, rate.rate * options_.batch.linger_us);
+      }
+      target_bytes += rate.target_bytes;
+    }
+    target_bytes_.store(target_bytes, std::memory_order_relaxed);
+  }
+
+  // Whether a pinned subscription's batch is still too small to go out. Holds it until the input rate promises no
+  // more or the oldest record waited linger_us.
+  bool linger_(const Sender *sender, Subscription *subscription, uint64_t head) {
+    if (options_.batch.linger_us == 0) {
+      return false;
+    }
+    const Ring &ring = subscription->channel->ring;
+    const Ring::Record &first = ring.record(subscription->cursor);
+    const Ring::Record &last = ring.record(head - 1);
+    const uint64_t available = last.position + last.length - first.position;
+    // relayed records count from their arrival here, they were generated long before
+    const int64_t arrival = (first.hops > 0) ? first.relay_timestamp : first.generate_timestamp;
+    const int64_t deadline = arrival + options_.batch.linger_us;
+    const int64_t now = Message::timestamp_us();
+    if (available < sender->rates[subscription->channel->id].target_bytes && now < deadline) {
+      if (subscription->linger_since == 0) {
+        subscription->linger_since = now;
+      }
+      subscription->linger_deadline = deadline;
+      return true;
+    }
+    if (subscription->linger_since != 0) {
+      linger_us_hist_.add_signed(now - subscription->linger_since);
+      subscription->linger_since = 0;
+    }
+    subscription->linger_deadline = 0;
+    return false;
+  }
+
+  // Handle what a client sent, returns false if it has to be disconnected.
+  bool receive_(Peer *peer) {
+    if (!peer->receiver) {
+      peer->receiver = std::make_unique<Receiver>(kMaxHelloSize);
+    }
+    while (true) {
+      const ssize_t length = peer->receiver->fill(peer->socket);
+      if (length == 0) {
+        return false;
+      }
+      if (length < 0) {
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+      }
+      // t2 of the clock probes in this read
+      const int64_t receive_timestamp = Message::timestamp_us();
+      const int64_t receive_steady_us = Message::steady_us();
+
+      const char *payload = nullptr;
+      for (const Frame *frame = peer->receiver->next(&payload); frame != nullptr;
+           frame = peer->receiver->next(&payload)) {
+        if (frame->flags & kFlagPing) {
+          pong_(peer, frame, receive_timestamp, receive_steady_us);
+        }
+        if ((frame->flags & kFlagHello) && !hello_(peer, parse_options(payload, frame->length))) {
+          return false;
+        }
+      }
+      if (peer->receiver->is_corrupt()) {
+        return false;
+      }
+      peer->receiver->compact();
+    }
+  }
+
+  // Answer a client's clock probe with when it arrived and how long it was held here, see Client::pong_.
+  void pong_(Peer *peer, const Frame *ping, int64_t receive_timestamp, int64_t receive_steady_us) {
+    Frame pong;
+    pong.generate_timestamp = ping->generate_timestamp;
+    pong.flags = kFlagPong;
+    const std::string payload = "receive=" + std::to_string(receive_timestamp) +
+                                "\nhold=" + std::to_string(Message::steady_us() - receive_steady_us) + "\n";
+    queue_(peer, &pong, payload);
+  }
+
+  // Append a control frame to what the peer is sent next, in the peer's wire version.
+  static void queue_(Peer *peer, Frame *frame, const std::string &payload) {
+    frame->version = peer->is_v2 ? kVersion2.version : kVersion.version;
+    frame->fields = kFieldsChannel;
+    frame->length = payload.size();
+    char header[kMaxFrameHeaderSize];
+    peer->pending.append(header, encode_frame(*frame, header));
+    peer->pending.append(payload);
+  }
+
+  // Returns false if the client has to be disconnected.
+  bool hello_(Peer *peer, const std::unordered_map<std::string, std::string> &options) {
+    for (const auto &[key, value] : options) {
+      Log::debug("Client %s option %s=%s", peer->address.c_str(), key.c_str(), value.c_str());
+    }
+    if (!peer->is_greeting) {
+      return true;
+    }
+    auto it = options.find("compress");
+    peer->is_compress = (it != options.end() && it->second == "lz");
+    it = options.find("hops");
+    peer->is_hops = (it != options.end() && it->second == "1");
+    it = options.find("range");
+    peer->is_range = (it != options.end() && it->second == "1");
+    it = options.find("wire");
+    peer->is_v2 = (it != options.end() && it->second == "2");
+    it = options.find("checksum");
+    peer->is_checksum = peer->is_v2 && (it != options.end() && it->second == "1");
+    it = options.find("index");
+    peer->is_index = peer->is_v2 && (it != options.end() && it->second == "1");
+    it = options.find("filter");
+    if (it != options.end()) {
+      peer->filter = compile_filter_(it->second);
+      if (!peer->filter) {
+        Log::info("Client %s sent invalid filter %s", peer->address.c_str(), it->second.c_str());
+        return false;
+      }
+    }
+    it = options.find("channels");
+    if (it != options.end() && !subscribe_(peer, it->second)) {
+      return false;
+    }
+    // "start.<channel>" overrides "start" for one channel, "count" ends each subscription that many records after
+    // where it asked to start and the connection once all of them are done
+    const auto count = options.find("count");
+    for (Subscription &subscription : peer->subscriptions) {
+      it = options.find("start." + subscription.channel->name);
+      if (it == options.end()) {
+        it = options.find("start");
+      }
+      const uint64_t start = (it != options.end()) ? seek_(peer, &subscription, it->second) : subscription.cursor;
+      if (count != options.end()) {
+        subscription.end = start + strtoull(count->second.c_str(), nullptr, 10);
+      }
+    }
+    peer->is_greeting = false;
+    return true;
+  }
+
+  // Trade the default subscription for the comma separated channels, answered with a hello of "<id>=<name>" lines.
+  // Unknown names are skipped, returns false if none is left.
+  bool subscribe_(Peer *peer, const std::string &names) {
+    std::vector<Channel *> channels;
+    for (size_t begin = 0; begin <= names.size();) {
+      size_t end = names.find(',', begin);
+      if (end == std::string::npos) {
+        end = names.size();
+      }
+      const std::string name = names.substr(begin, end - begin);
+      Channel *channel = find_channel_(name);
+      if (channel == nullptr) {
+        Log::info("Client %s asked for unknown channel %s", peer->address.c_str(), name.c_str());
+      } else if (std::find(channels.begin(), channels.end(), channel) == channels.end()) {
+        channels.push_back(channel);
+      }
+      begin = end + 1;
+    }
+    if (channels.empty()) {
+      return false;
+    }
+
+    unsubscribe_(peer);
+    std::string answer = "";
+    for (Channel *channel : channels) {
+      Subscription subscription;
+      subscription.channel = channel;
+      subscription.cursor = channel->ring.start();
+      subscription.reader = channel->ring.attach(subscription.cursor);
+      if (subscription.reader < 0) {
+        Log::error("Too many clients on channel %s, reject %s", channel->name.c_str(), peer->address.c_str());
+        return false;
+      }
+      peer->subscriptions.push_back(subscription);
+      answer += std::to_string(channel->id) + "=" + channel->name + "\n";
+    }
+    peer->is_multiplexed = true;
+    notice_(peer, channels.front(), 0, answer);
+    return true;
+  }
+
+  void unsubscribe_(Peer *peer) {
+    for (const Subscription &subscription : peer->subscriptions) {
+      subscription.channel->ring.detach(subscription.reader);
+    }
+    peer->subscriptions.clear();
+    peer->next_subscription = 0;
+  }
+
+  // Move a new subscription back into the retained history: "latest" keeps the live position, "bytes:N" replays the
+  // last N payload bytes, "index:I" starts at the record a frame with body.index I began with and "resume:S"
+  // continues after the frame that carried send_bytes S. Returns the sequence asked for, which may be gone.
+  uint64_t seek_(Peer *peer, Subscription *subscription, const std::string &start) {
+    const size_t colon = start.find(':');
+    const std::string kind = start.substr(0, colon);
+    if (colon == std::string::npos || (kind != "bytes" && kind != "index" && kind != "resume")) {
+      return subscription->cursor;
+    }
+    char *end = nullptr;
+    const char *text = start.c_str() + colon + 1;
+    const uint64_t value = strtoull(text, &end, 10);
+    if (end == text || *end != '\0') {
+      Log::info("Client %s sent invalid start %s", peer->address.c_str(), start.c_str());
+      return subscription->cursor;
+    }
+
+    // pinned at the oldest record, nothing in [oldest, head) can be reclaimed while seeking
+    Ring &ring = subscription->channel->ring;
+    uint64_t dropped = 0;
+    const uint64_t oldest = ring.acquire(subscription->reader, ring.tail(), &dropped);
+    const uint64_t head = ring.head();
+    const uint64_t end_position = stream_position_(ring, head, head);
+    uint64_t cursor = oldest;
+    uint64_t asked = oldest;
+    if (kind == "bytes") {
+      const uint64_t payload_end = end_position - sizeof(Message) * head;
+      cursor = ring.bisect(oldest, head, [&](const Ring::Record &record, uint64_t) {
+        return payload_end - record.position <= value;
+      });
+    } else if (kind == "index") {
+      // body.index is the record sequence cut to 32 bits, take the latest sequence it can stand for
+      const uint64_t seq = head - static_cast<uint32_t>(static_cast<uint32_t>(head) - static_cast<uint32_t>(value));
+      if (seq < oldest) {
+        Log::info("Client %s starts at index %lu, %lu messages are gone", peer->address.c_str(), value,
+                  oldest - seq);
+      }
+      cursor = std::max(seq, oldest);
+      asked = seq;
+    } else {
+      // a position past the end comes from an earlier server, the client starts over with what is retained
+      if (value <= end_position) {
+        cursor = ring.bisect(oldest, head, [&](const Ring::Record &record, uint64_t seq) {
+          return record.position + sizeof(Message) * seq >= value;
+        });
+      }
+      notice_(peer, subscription->channel, stream_position_(ring, cursor, head));
+    }
+    subscription->cursor = cursor;
+    ring.release(subscription->reader, subscription->cursor);
+    Log::debug("Client %s replays %lu messages of channel %s", peer->address.c_str(), head - cursor,
+               subscription->channel->name.c_str());
+    return (kind == "index") ? asked : cursor;
+  }
+
+  // Where record `seq` starts in the stream send_bytes counts: the payload plus one Message for each record before.
+  // `seq` may be `head`, the end of the stream. Only valid while pinned at or below `seq`.
+  static uint64_t stream_position_(const Ring &ring, uint64_t seq, uint64_t head) {
+    if (seq < head) {
+      return ring.record(seq).position + sizeof(Message) * seq;
+    }
+    if (head == 0) {
+      return 0;
+    }
+    const Ring::Record &last = ring.record(head - 1);
+    return last.position + last.length + sizeof(Message) * head;
+  }
+
+  // Queue a hello frame ahead of any data. With a payload it answers a subscription, without one it tells a
+  // resuming client where the channel's stream continues, in send_bytes.
+  void notice_(Peer *peer, const Channel *channel, uint64_t position, const std::string &payload = "") {
+    Frame notice;
+    notice.generate_timestamp = Message::timestamp_us();
+    notice.send_bytes = position;
+    notice.flags = kFlagHello;
+    notice.channel = channel->id;
+    queue_(peer, &notice, payload);
+  }
+
+  // Apply the lag policy to an acquired subscription, `window` holds its cursor. Returns false if the peer has to be
+  // disconnected.
+  bool check_lag_(Peer *peer, Subscription *subscription, const Ring::Window &window, uint64_t head) {
+    if (options_.max_lag == 0 || subscription->cursor >= head) {
+      return true;
+    }
+    const Ring &ring = subscription->channel->ring;
+    // the ring may have moved on from head - 1 while the cursor is spilled, measure against what was written last
+    const uint64_t end_position =
+        window.is_spilled() ? ring.written() : ring.record(head - 1).position + ring.record(head - 1).length;
+    uint64_t lag = end_position - window.record(subscription->cursor).position;
+    if (lag <= options_.max_lag) {
+      return true;
+    }
+    if (options_.lag_policy == LagPolicy::kDisconnect) {
+      Log::info("Client %s lags %lu bytes behind, disconnect", peer->address.c_str(), lag);
+      ++lag_disconnects_;
+      return false;
+    }
+
+    if (window.is_spilled()) {
+      // drop the rest of the segment, the next pass measures again from there
+      const uint64_t begin = subscription->cursor;
+      const Ring::Record &last = window.record(window.end_seq() - 1);
+      const uint64_t bytes = last.position + last.length - window.record(begin).position;
+      subscription->cursor = window.end_seq();
+      peer->drop_records += subscription->cursor - begin;
+      peer->drop_bytes += bytes;
+      lag_drops_ += bytes;
+      return true;
+    }
+
+    const uint64_t begin = subscription->cursor;
+    const uint64_t begin_lag = lag;
+    while (subscription->cursor < head && lag > options_.max_lag) {
+      ++subscription->cursor;
+      lag = (subscription->cursor < head) ? end_position - ring.record(subscription->cursor).position : 0;
+    }
+    peer->drop_records += subscription->cursor - begin;
+    peer->drop_bytes += begin_lag - lag;
+    lag_drops_ += begin_lag - lag;
+    Log::debug("Client %s lags behind, drop %lu messages, total dropped: %lu bytes", peer->address.c_str(),
+               subscription->cursor - begin, peer->drop_bytes);
+    return true;
+  }
+
+  // Next subscription with records before its channel's head in `heads`, taking turns. nullptr if there is none.
+  Subscription *next_subscription_(Peer *peer, const std::vector<uint64_t> &heads) const {
+    const size_t count = peer->subscriptions.size();
+    for (size_t i = 0; i < count; ++i) {
+      Subscription &subscription = peer->subscriptions[(peer->next_subscription + i) % count];
+      if (subscription.cursor < std::min(heads[subscription.channel->id], subscription.end)) {
+        peer->next_subscription = (peer->next_subscription + i + 1) % count;
+        return &subscription;
+      }
+    }
+    return nullptr;
+  }
+
+  // Hand one batch of frames of one channel, or what is left of one, to the socket. `is_sent` tells whether anything
+  // went out. Returns false if the peer has to be disconnected.
+  bool flush_(Sender *sender, Peer *peer, const std::vector<uint64_t> &heads, bool *is_sent) {
+    *is_sent = false;
+    if (peer->is_greeting) {
+      if (Message::timestamp_us() < peer->greeting_deadline) {
+        return true;
+      }
+      peer->is_greeting = false;
+    }
+    if (!peer->is_writable) {
+      return true;
+    }
+    // each client's sends stay in flight until the pass completes them all, with epoll one is done at a time
+    Transfer *transfer = &sender->transfer;
+    if (sender->uring) {
+      if (!peer->transfer) {
+        peer->transfer = std::make_unique<Transfer>();
+      }
+      transfer = peer->transfer.get();
+    }
+    if (peer->pending_offset < peer->pending.size()) {
+      transfer->subscription = nullptr;
+      transfer->iov[0].iov_base = const_cast<char *>(peer->pending.data() + peer->pending_offset);
+      transfer->iov[0].iov_len = peer->pending.size() - peer->pending_offset;
+      transfer->iov_count = 1;
+      return transmit_(sender, peer, transfer, is_sent);
+    }
+    Subscription *subscription = next_subscription_(peer, heads);
+    if (subscription == nullptr) {
+      // a client that asked for a range is done once it has all of it
+      return !std::all_of(peer->subscriptions.begin(), peer->subscriptions.end(),
+                          [](const Subscription &subscription) { return subscription.cursor >= subscription.end; });
+    }
+    Channel *channel = subscription->channel;
+    Ring &ring = channel->ring;
+    const uint64_t head = std::min(heads[channel->id], subscription->end);
+
+    uint64_t dropped = 0;
+    subscription->cursor = ring.acquire(subscription->reader, subscription->cursor, &dropped);
+    if (dropped > 0) {
+      peer->drop_records += dropped;
+      drop_records_.fetch_add(dropped, std::memory_order_relaxed);
+      Log::debug("Drop %lu messages, client: %s, total dropped: %lu", dropped, peer->address.c_str(),
+                 peer->drop_records);
+    }
+    transfer->window = ring.window(subscription->cursor);
+    const Ring::Window &window = transfer->window;
+    if (!check_lag_(peer, subscription, window, head)) {
+      ring.release(subscription->reader, subscription->cursor);
+      return false;
+    }
+    // a spilled batch ends with its segment
+    const uint64_t limit = std::min(head, window.end_seq());
+    if (subscription->cursor >= limit) {
+      ring.release(subscription->reader, subscription->cursor);
+      *is_sent = subscription->cursor < head;
+      return true;
+    }
+
+    if (!window.is_spilled() && linger_(sender, subscription, head)) {
+      ring.release(subscription->reader, subscription->cursor);
+      return true;
+    }
+
+    // cut up to max_frames frames and hand them to the socket at once
+    const uint64_t begin = subscription->cursor;
+    uint64_t end = begin;
+    int32_t iov_count = 0;
+    uint32_t frames = 0;
+    // a v1 header cannot describe more
+    const uint64_t max_bytes =
+        peer->is_v2 ? options_.batch.max_bytes : std::min(options_.batch.max_bytes, kMaxMessageLength);
+    // the index of a frame stays within max_bytes as well, whatever the timestamps are
+    const uint32_t overhead = (peer->is_index && !peer->filter) ? kMaxIndexEntrySize : 0;
+    // frames a filter emptied count as cut, so a batch never scans more than max_frames worth of records
+    for (uint32_t cut = 0; cut < options_.batch.max_frames && end < limit; ++cut) {
+      uint64_t length = 0;
+      const uint64_t next = coalesce_(window, end, limit, max_bytes, overhead, &length);
+      const int32_t used = frame_(sender, peer, channel, window, frames, end, next, length,
+                                  &transfer->headers[frames], transfer->iov + iov_count);
+      batch_records_hist_.add(next - end);
+      batch_bytes_hist_.add(length);
+      end = next;
+      if (used == 0) {
+        continue;
+      }
+      iov_count += used;
+      send_delay_us_hist_.add_signed(transfer->headers[frames].frame.send_timestamp);
+      ++frames;
+    }
+    if (iov_count == 0) {
+      subscription->cursor = end;
+      ring.release(subscription->reader, subscription->cursor);
+      *is_sent = true;
+      return true;
+    }
+    transfer->subscription = subscription;
+    transfer->begin = begin;
+    transfer->end = end;
+    transfer->head = head;
+    transfer->frames = frames;
+    transfer->iov_count = iov_count;
+    return transmit_(sender, peer, transfer, is_sent);
+  }
+
+  // Hand a transfer to the socket: queued on the sender's io_uring, completed once the pass submitted it, or with
+  // sendmsg right away. Returns false if the peer has to be disconnected.
+  bool transmit_(Sender *sender, Peer *peer, Transfer *transfer, bool *is_sent) {
+    transfer->msg = {};
+    transfer->msg.msg_iov = transfer->iov;
+    transfer->msg.msg_iovlen = transfer->iov_count;
+    if (sender->uring && sender->uring->sendmsg(peer->socket, &transfer->msg, MSG_NOSIGNAL,
+                                                reinterpret_cast<uint64_t>(peer))) {
+      ++sender->in_flight;
+      return true;
+    }
+    const ssize_t sent = sendmsg(peer->socket, &transfer->msg, MSG_NOSIGNAL);
+    return complete_(peer, transfer, (sent < 0) ? -errno : sent, is_sent);
+  }
+
+  // Account for what the socket took of a transfer, `result` is what sendmsg returned or the negated errno. Returns
+  // false if the peer has to be disconnected.
+  bool complete_(Peer *peer, Transfer *transfer, ssize_t result, bool *is_sent) {
+    Subscription *subscription = transfer->subscription;
+    if (result < 0) {
+      if (subscription != nullptr) {
+        subscription->channel->ring.release(subscription->reader, subscription->cursor);
+      }
+      if (result == -EAGAIN || result == -EWOULDBLOCK) {
+        peer->is_writable = false;
+        return true;
+      }
+      return false;
+    }
+    const size_t sent = result;
+    send_bytes_.fetch_add(sent, std::memory_order_relaxed);
+    *is_sent = true;
+    if (subscription == nullptr) {
+      peer->pending_offset += sent;
+      if (peer->pending_offset == peer->pending.size()) {
+        peer->pending.clear();
+        peer->pending_offset = 0;
+      }
+      return true;
+    }
+
+    const struct iovec *iov = transfer->iov;
+    size_t frame_size = 0;
+    for (int32_t i = 0; i < transfer->iov_count; ++i) {
+      frame_size += iov[i].iov_len;
+    }
+    if (sent < frame_size) {
+      // keep the rest so the cursor never pins a half sent frame
+      peer->pending.clear();
+      peer->pending_offset = 0;
+      size_t skip = sent;
+      for (int32_t i = 0; i < transfer->iov_count; ++i) {
+        if (skip < iov[i].iov_len) {
+          peer->pending.append(static_cast<const char *>(iov[i].iov_base) + skip, iov[i].iov_len - skip);
+        }
+        skip -= std::min(skip, iov[i].iov_len);
+      }
+    }
+    queue_depth_hist_.add(transfer->head - transfer->begin);
+    batch_frames_hist_.add(transfer->frames);
+    subscription->cursor = transfer->end;
+    subscription->channel->ring.release(subscription->reader, subscription->cursor);
+    frames_.fetch_add(transfer->frames, std::memory_order_relaxed);
+    transfer->window = Ring::Window();
+    Log::debug("Send %lu Bytes, curernt %lu", send_bytes_.load(), sent);
+    return true;
+  }
+
+  // Submit the sends queued by a pass and wait for all of them, one system call for every client of the sender.
+  // Returns whether any of them sent something.
+  bool complete_all_(Sender *sender) {
+    bool is_progress = false;
+    while (sender->in_flight > 0) {
+      const int32_t result = sender->uring->submit(sender->in_flight);
+      if (result < 0 && result != -EINTR) {
+        // nothing is known about the sends, let them finish rather than pull their buffers away
+        Log::error("Failed to submit to io_uring: %s", strerror(-result));
+      }
+      sender->in_flight -= sender->uring->reap([&](uint64_t user_data, int32_t res, uint32_t) {
+        Peer *peer = reinterpret_cast<Peer *>(user_data);
+        bool is_sent = false;
+        if (!complete_(peer, peer->transfer.get(), res, &is_sent)) {
+          peer->is_closed = true;
+          sender->failed.push_back(peer);
+        }
+        is_progress |= is_sent;
+      });
+    }
+    return is_progress;
+  }
+
+  void disconnect_(Sender *sender, Peer *peer) {
+    epoll_ctl(sender->epoll_fd, EPOLL_CTL_DEL, peer->socket, NULL);
+    --sender->client_count;
+    // out of clients_ before the fd is closed, accept may hand out its number again right after
+    std::unique_ptr<Peer> owned;
+    size_t client_count = 0;
     {
-      std::lock_guard<std::mutex> lock(messages_mutex_);
-      messages_.push_back(message);
-      if (is_drop && (messages_.size() > kMaxMessageQueueSize)) {
-        Log::debug("Drop message: %s", messages_.front().c_str());
-        messages_.pop_front();
+      std::lock_guard<std::mutex> lock(clients_mutex_);
+      auto it = clients_.find(peer->socket);
+      if (it != clients_.end() && it->second.get() == peer) {
+        owned = std::move(it->second);
+        clients_.erase(it);
       }
+      client_count = clients_.size();
+      client_count_ = client_count;
     }
-    messages_condition_.notify_one();
+    close(peer->socket);
+    unsubscribe_(peer);
+    Log::debug("Client disconnected, address: %s, dropped: %lu messages", peer->address.c_str(), peer->drop_records);
+    sender->is_changed = true;
+    Log::debug("Client count: %lu", client_count);
   }
 
   void process_() {
     client_thread_ = std::thread([this]() {
-      const int32_t epoll_fd = epoll_create1(0);
-      if (epoll_fd == -1) {
-        throw "Failed to create epoll\n";
+      if (!options_.is_uring || !accept_uring_()) {
+        accept_loop_();
       }
+    });
+
+    for (auto &sender : senders_) {
+      sender->thread = std::thread([this, sender = sender.get()]() { send_loop_(sender); });
+    }
+    if (multicast_socket_ >= 0) {
+      multicast_thread_ = std::thread([this]() { multicast_loop_(); });
+    }
+    if (shm_) {
+      shm_thread_ = std::thread([this]() { shm_loop_(); });
+    }
+  }
 
-      struct epoll_event event;
-      event.events = EPOLLIN;
-      event.data.fd = server_socket_;
-      if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket_, &event) == -1) {
-        throw "Failed to add server socket to epoll\n";
+  void accept_loop_() {
+    const int32_t epoll_fd = epoll_create1(0);
+    if (epoll_fd == -1) {
+      throw "Failed to create epoll\n";
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.fd = server_socket_;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket_, &event) == -1) {
+      throw "Failed to add server socket to epoll\n";
+    }
+
+    struct epoll_event events[1];
+    while (!stop_) {
+      const int32_t nfds = epoll_wait(epoll_fd, events, 1, 500);
+      if (nfds < 0) {
+        Log::error("Failed to wait epoll");
+      }
+      if (nfds <= 0) {
+        continue;
+      }
+
+      struct sockaddr_in client_address;
+      socklen_t client_address_length = sizeof(client_address);
+      const int32_t client_socket =
+          accept4(server_socket_, (struct sockaddr *)&client_address, &client_address_length, SOCK_NONBLOCK);
+      if (client_socket < 0) {
+        Log::error("Failed to accept client");
+        continue;
       }
+      accepted_(client_socket, client_address);
+    }
+
+    close(epoll_fd);
+  }
 
-      struct epoll_event events[1];
-      while (!stop_) {
-        const int32_t nfds = epoll_wait(epoll_fd, events, 1, 500);
-        if (nfds < 0) {
-          Log::error("Failed to wait epoll");
+  // One multishot accept stays armed for every connection to come. Returns false if the kernel cannot do that, before
+  // anything was accepted.
+  bool accept_uring_() {
+    std::unique_ptr<Uring> uring = Uring::create(1);
+    if (!uring) {
+      return false;
+    }
+    bool is_armed = false;
+    bool is_accepted = false;
+    while (!stop_) {
+      if (!is_armed) {
+        is_armed = uring->accept_multishot(server_socket_, SOCK_NONBLOCK, 0);
+      }
+      const int32_t result = uring->submit(1, 500 * 1000);
+      if (result < 0 && result != -ETIME && result != -EINTR) {
+        Log::error("Failed to wait for io_uring: %s", strerror(-result));
+      }
+      bool is_unsupported = false;
+      uring->reap([&](uint64_t, int32_t res, uint32_t flags) {
+        is_armed = (flags & IORING_CQE_F_MORE) != 0;
+        if (res == -EINVAL && !is_accepted) {
+          is_unsupported = true;
+          return;
         }
-        if (nfds <= 0) {
-          continue;
+        if (res < 0) {
+          Log::error("Failed to accept client: %s", strerror(-res));
+          return;
         }
+        struct sockaddr_in client_address = {};
+        socklen_t client_address_length = sizeof(client_address);
+        getpeername(res, (struct sockaddr *)&client_address, &client_address_length);
+        is_accepted = true;
+        accepted_(res, client_address);
+      });
+      if (is_unsupported) {
+        Log::info("Multishot accept is not available, using epoll");
+        return false;
+      }
+    }
+    return true;
+  }
 
-        const int32_t client_socket = accept(server_socket_, NULL, NULL);
-        if (client_socket < 0) {
-          Log::error("Failed to accept client");
-          continue;
+  // Set up a new connection and hand it to the least loaded sender.
+  void accepted_(int32_t client_socket, const struct sockaddr_in &client_address) {
+    // batching is up to BatchOptions, Nagle would only hold the last partial frame back
+    int32_t no_delay = 1;
+    setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+
+    std::unique_ptr<Peer> peer = std::make_unique<Peer>();
+    peer->socket = client_socket;
+    peer->address = std::string(inet_ntoa(client_address.sin_addr)) + ":" +
+                    std::to_string(ntohs(client_address.sin_port));
+    peer->greeting_deadline = Message::timestamp_us() + kHelloTimeoutMs * 1000;
+    // old clients never subscribe, they get the first channel
+    Subscription subscription;
+    subscription.channel = channels_.front().get();
+    subscription.cursor = subscription.channel->ring.start();
+    subscription.reader = subscription.channel->ring.attach(subscription.cursor);
+    if (subscription.reader < 0) {
+      Log::error("Too many clients, reject %s", peer->address.c_str());
+      close(client_socket);
+      return;
+    }
+    peer->subscriptions.push_back(subscription);
+
+    // balance on accept: the sender with the fewest clients takes the new one
+    Sender *sender = least_loaded_();
+    peer->sender = sender->index;
+    Peer *added = peer.get();
+    size_t client_count = 0;
+    {
+      std::lock_guard<std::mutex> lock(clients_mutex_);
+      clients_[client_socket] = std::move(peer);
+      client_count = clients_.size();
+      client_count_ = client_count;
+    }
+    if (!watch_(sender, added)) {
+      Log::error("Failed to add client socket to epoll");
+      std::lock_guard<std::mutex> lock(clients_mutex_);
+      unsubscribe_(added);
+      clients_.erase(client_socket);
+      close(client_socket);
+      return;
+    }
+    ++sender->client_count;
+    sender->is_changed = true;
+    Log::debug("New client connected, socket: %d, sender: %d, client count: %lu", client_socket, sender->index,
+               client_count);
+  }
+
+  void open_multicast_() {
+    const size_t colon = options_.multicast.find(':');
+    multicast_address_.sin_family = AF_INET;
+    if (colon == std::string::npos ||
+        inet_pton(AF_INET, options_.multicast.substr(0, colon).c_str(), &multicast_address_.sin_addr) != 1) {
+      throw "Invalid multicast group\n";
+    }
+    multicast_address_.sin_port = htons(std::stoi(options_.multicast.substr(colon + 1)));
+    multicast_socket_ = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (multicast_socket_ < 0) {
+      throw "Failed to create multicast socket\n";
+    }
+    const int32_t ttl = kMulticastTtl;
+    setsockopt(multicast_socket_, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    // clients on this host get the group too
+    const uint8_t loop = 1;
+    setsockopt(multicast_socket_, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+  }
+
+  // Sends every channel once to the multicast group however many clients listen. It holds a reader on each ring like
+  // a client, so drop and no drop apply to it as well.
+  void multicast_loop_() {
+    const int32_t waiter = options_.senders;
+    std::vector<int32_t> readers;
+    std::vector<uint64_t> cursors;
+    // send_bytes of the last frame of each channel, for heartbeats
+    std::vector<uint64_t> positions(channels_.size(), 0);
+    std::vector<struct pollfd> fds;
+    for (const auto &channel : channels_) {
+      cursors.push_back(channel->ring.start());
+      readers.push_back(channel->ring.attach(cursors.back()));
+      fds.push_back({channel->ring.event_fd(waiter), POLLIN, 0});
+    }
+    while (!stop_) {
+      bool is_sent = false;
+      for (const auto &channel : channels_) {
+        is_sent |= multicast_(channel.get(), readers[channel->id], &cursors[channel->id], &positions[channel->id]);
+      }
+      if (is_sent) {
+        continue;
+      }
+      bool is_armed = true;
+      for (const auto &channel : channels_) {
+        is_armed &= channel->ring.arm(cursors[channel->id], waiter);
+      }
+      // idle, tell clients where each channel is so that they notice a lost tail as well
+      if (is_armed && poll(fds.data(), fds.size(), kMulticastHeartbeatMs) == 0) {
+        for (const auto &channel : channels_) {
+          Frame heartbeat;
+          heartbeat.fields = kFieldsRange;
+          heartbeat.generate_timestamp = Message::timestamp_us();
+          heartbeat.index = cursors[channel->id];
+          heartbeat.send_bytes = positions[channel->id];
+          heartbeat.channel = channel->id;
+          char header[kMaxFrameHeaderSize];
+          const uint32_t header_size = encode_frame(heartbeat, header);
+          sendto(multicast_socket_, header, header_size, 0, (struct sockaddr *)&multicast_address_,
+                 sizeof(multicast_address_));
         }
+      }
+      for (const auto &channel : channels_) {
+        channel->ring.disarm(waiter);
+      }
+    }
+    for (const auto &channel : channels_) {
+      channel->ring.detach(readers[channel->id]);
+    }
+  }
 
-        {
-          std::lock_guard<std::mutex> lock(clients_mutex_);
-          client_sockets_.insert(client_socket);
+  // One round of datagrams from a channel, returns whether anything was sent. Records the ring dropped before they
+  // went out and datagrams the network loses look the same to clients, a gap in body.index.
+  bool multicast_(Channel *channel, int32_t reader, uint64_t *cursor, uint64_t *position) {
+    Ring &ring = channel->ring;
+    const uint64_t head = ring.head();
+    if (reader < 0 || *cursor >= head) {
+      return false;
+    }
+    uint64_t dropped = 0;
+    *cursor = ring.acquire(reader, *cursor, &dropped);
+    const Ring::Window window = ring.window(*cursor);
+    const uint64_t limit = std::min(head, window.end_seq());
+    const uint64_t max_bytes = std::min(options_.batch.max_bytes, kMulticastPayload);
+    uint32_t frames = 0;
+    for (; frames < options_.batch.max_frames && *cursor < limit; ++frames) {
+      uint64_t length = 0;
+      const uint64_t end = coalesce_(window, *cursor, limit, max_bytes, 0, &length);
+      FrameHeader header;
+      describe_(&header, channel, window, *cursor, end, length);
+      // v1, every client reads it
+      header.frame.fields = kFieldsRange;
+      *position = header.frame.send_bytes;
+      const uint64_t begin = window.record(*cursor).position;
+      // only a single record is ever longer, it goes out in pieces that clients put together again
+      if (length > max_bytes) {
+        header.frame.flags |= kFlagFragment;
+        header.frame.raw_length = length;
+      }
+      uint64_t offset = 0;
+      do {
+        const uint64_t piece = std::min(length - offset, max_bytes);
+        header.frame.length = piece;
+        const uint32_t header_size = encode_frame(header.frame, header.bytes);
+        Ring::Span spans[2];
+        const int32_t count = window.spans(begin + offset, begin + offset + piece, spans);
+        struct iovec iov[3] = {{header.bytes, header_size}};
+        for (int32_t i = 0; i < count; ++i) {
+          iov[i + 1] = {const_cast<char *>(spans[i].data), spans[i].size};
+        }
+        struct msghdr datagram = {};
+        datagram.msg_name = &multicast_address_;
+        datagram.msg_namelen = sizeof(multicast_address_);
+        datagram.msg_iov = iov;
+        datagram.msg_iovlen = count + 1;
+        const ssize_t sent = sendmsg(multicast_socket_, &datagram, 0);
+        if (sent < 0) {
+          multicast_errors_.fetch_add(1, std::memory_order_relaxed);
+          Log::debug("Failed to send %lu bytes to the multicast group: %s", header_size + piece, strerror(errno));
+        } else {
+          multicast_bytes_.fetch_add(sent, std::memory_order_relaxed);
+          multicast_datagrams_.fetch_add(1, std::memory_order_relaxed);
         }
-        clients_condition_.notify_one();
-        Log::debug("New client connected, socket: %d, client count: %lu", client_socket, client_sockets_.size());
+        offset += piece;
+      } while (offset < length);
+      *cursor = end;
+    }
+    ring.release(reader, *cursor);
+    return frames > 0;
+  }
+
+  // Copies every channel once to shared memory however many local clients map it. It holds a reader on each ring
+  // like a client, so drop and no drop apply to it as well, clients that fall behind in shared memory lose records.
+  void shm_loop_() {
+    const int32_t waiter = options_.senders + (options_.multicast.empty() ? 0 : 1);
+    std::vector<int32_t> readers;
+    std::vector<uint64_t> cursors;
+    std::vector<struct pollfd> fds;
+    for (const auto &channel : channels_) {
+      cursors.push_back(channel->ring.start());
+      readers.push_back(channel->ring.attach(cursors.back()));
+      fds.push_back({channel->ring.event_fd(waiter), POLLIN, 0});
+    }
+    while (!stop_) {
+      bool is_written = false;
+      for (const auto &channel : channels_) {
+        is_written |= copy_to_shm_(channel.get(), readers[channel->id], &cursors[channel->id]);
+      }
+      if (is_written) {
+        shm_->notify();
+        continue;
+      }
+      bool is_armed = true;
+      for (const auto &channel : channels_) {
+        is_armed &= channel->ring.arm(cursors[channel->id], waiter);
+      }
+      if (is_armed) {
+        poll(fds.data(), fds.size(), -1);
       }
+      for (const auto &channel : channels_) {
+        channel->ring.disarm(waiter);
+      }
+    }
+    for (const auto &channel : channels_) {
+      channel->ring.detach(readers[channel->id]);
+    }
+  }
 
-      close(epoll_fd);
-    });
+  // Copy what a channel has past `cursor` to shared memory, returns whether there was anything.
+  bool copy_to_shm_(Channel *channel, int32_t reader, uint64_t *cursor) {
+    Ring &ring = channel->ring;
+    const uint64_t head = ring.head();
+    if (reader < 0 || *cursor >= head) {
+      return false;
+    }
+    uint64_t dropped = 0;
+    *cursor = ring.acquire(reader, *cursor, &dropped);
+    const Ring::Window window = ring.window(*cursor);
+    const uint64_t limit = std::min(head, window.end_seq());
+    for (; *cursor < limit; ++*cursor) {
+      const Ring::Record &record = window.record(*cursor);
+      Ring::Span spans[2];
+      const int32_t count = window.spans(record.position, record.position + record.length, spans);
+      struct iovec iov[2];
+      for (int32_t i = 0; i < count; ++i) {
+        iov[i] = {const_cast<char *>(spans[i].data), spans[i].size};
+      }
+      shm_->write(channel->id, iov, count, record.generate_timestamp);
+      shm_records_.fetch_add(1, std::memory_order_relaxed);
+    }
+    ring.release(reader, *cursor);
+    return true;
+  }
 
-    server_thread_ = std::thread([this]() {
-      std::string message = "";
-      uint64_t send_bytes = 0;
-      while (!stop_) {
-        {
-          std::unique_lock<std::mutex> lock(clients_mutex_);
-          clients_condition_.wait(lock, [this] { return !client_sockets_.empty() || stop_; });
-          if (stop_) {
-            break;
+  Sender *least_loaded_() const {
+    Sender *result = senders_.front().get();
+    for (const auto &sender : senders_) {
+      if (sender->client_count < result->client_count) {
+        result = sender.get();
+      }
+    }
+    return result;
+  }
+
+  bool watch_(Sender *sender, Peer *peer) {
+    struct epoll_event client_event;
+    client_event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    client_event.data.ptr = peer;
+    return epoll_ctl(sender->epoll_fd, EPOLL_CTL_ADD, peer->socket, &client_event) == 0;
+  }
+
+  // Balance on disconnect: a sender with two clients more than the least loaded one hands over an idle client.
+  // The peer moves with its cursor, the new sender picks it up through its own epoll.
+  void rebalance_(Sender *sender, const std::vector<Peer *> &peers) {
+    Sender *target = least_loaded_();
+    if (sender->client_count <= target->client_count + 1) {
+      return;
+    }
+    for (Peer *peer : peers) {
+      if (peer->is_closed || peer->is_greeting || !peer->pending.empty()) {
+        continue;
+      }
+      epoll_ctl(sender->epoll_fd, EPOLL_CTL_DEL, peer->socket, NULL);
+      peer->is_writable = false;
+      for (Subscription &subscription : peer->subscriptions) {
+        subscription.linger_since = 0;
+        subscription.linger_deadline = 0;
+      }
+      {
+        std::lock_guard<std::mutex> lock(clients_mutex_);
+        peer->sender = target->index;
+      }
+      --sender->client_count;
+      ++target->client_count;
+      sender->is_changed = true;
+      if (!watch_(target, peer)) {
+        Log::error("Failed to move client %s", peer->address.c_str());
+      }
+      target->is_changed = true;
+      Log::debug("Move client %s from sender %d to %d", peer->address.c_str(), sender->index, target->index);
+      return;
+    }
+  }
+
+  void send_loop_(Sender *sender) {
+    std::vector<Peer *> peers;
+    std::vector<Peer *> closed;
+    // one per channel, taken once per pass
+    std::vector<uint64_t> heads(channels_.size(), 0);
+    struct epoll_event events[64];
+    int32_t timeout_ms = 0;
+    while (!stop_) {
+      const int32_t nfds = epoll_wait(sender->epoll_fd, events, sizeof(events) / sizeof(events[0]), timeout_ms);
+      if (nfds < 0 && errno != EINTR) {
+        Log::error("Failed to wait epoll");
+      }
+
+      if (sender->is_changed.exchange(false)) {
+        std::lock_guard<std::mutex> lock(clients_mutex_);
+        peers.clear();
+        for (const auto &[client_socket, peer] : clients_) {
+          if (peer->sender == sender->index) {
+            peers.push_back(peer.get());
           }
         }
+        // drop the caches of filters none of this sender's clients uses any more
+        for (auto it = sender->filtered.begin(); it != sender->filtered.end();) {
+          const bool is_used = std::any_of(peers.begin(), peers.end(), [&](const Peer *peer) {
+            return peer->filter && peer->filter->id() == it->first;
+          });
+          it = is_used ? std::next(it) : sender->filtered.erase(it);
+        }
+      }
 
-        {
-          std::unique_lock<std::mutex> lock(messages_mutex_);
-          messages_condition_.wait(lock, [this] { return !messages_.empty() || stop_; });
-          if (stop_) {
-            break;
+      closed.clear();
+      for (int32_t i = 0; i < nfds; ++i) {
+        Peer *peer = static_cast<Peer *>(events[i].data.ptr);
+        if (peer == nullptr) {
+          // one of the rings, cheaper to drain all eventfds than to tell them apart
+          for (auto &channel : channels_) {
+            channel->ring.disarm(sender->index);
           }
+          continue;
+        }
+        if (events[i].events & EPOLLOUT) {
+          peer->is_writable = true;
         }
+        if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+          closed.push_back(peer);
+          continue;
+        }
+        if ((events[i].events & EPOLLIN) && !receive_(peer)) {
+          closed.push_back(peer);
+        }
+      }
+      for (Peer *peer : closed) {
+        disconnect_(sender, peer);
+      }
+      if (!closed.empty()) {
+        continue;
+      }
 
-        {
-          message = "";
-          std::lock_guard<std::mutex> lock(messages_mutex_);
-          while (message.size() < kMaxMessageSize && !messages_.empty()) {
-            const std::string &front_message = messages_.front();
-            if (!message.empty()) {
-              Message *const origin_msg = reinterpret_cast<Message *>(const_cast<char *>(message.c_str()));
-              const Message *const current_msg = reinterpret_cast<Message *>(const_cast<char *>(front_message.c_str()));
-              origin_msg->body.length += current_msg->body.length;
-              message += front_message.substr(sizeof(Message));
-            } else {
-              message += messages_.front();
-            }
-            messages_.pop_front();
+      measure_rate_(sender);
+      for (const auto &channel : channels_) {
+        heads[channel->id] = channel->ring.head();
+      }
+      bool has_work = false;
+      bool is_waiting = false;
+      // earliest greeting or linger deadline
+      int64_t deadline = INT64_MAX;
+      for (Peer *peer : peers) {
+        if (peer->is_writable || options_.max_lag == 0) {
+          continue;
+        }
+        // a stalled socket never reaches flush_, still hold it to the lag policy
+        for (Subscription &subscription : peer->subscriptions) {
+          Ring &ring = subscription.channel->ring;
+          const uint64_t head = heads[subscription.channel->id];
+          if (subscription.cursor >= head) {
+            continue;
+          }
+          uint64_t dropped = 0;
+          subscription.cursor = ring.acquire(subscription.reader, subscription.cursor, &dropped);
+          peer->drop_records += dropped;
+          drop_records_.fetch_add(dropped, std::memory_order_relaxed);
+          const bool is_alive = check_lag_(peer, &subscription, ring.window(subscription.cursor), head);
+          ring.release(subscription.reader, subscription.cursor);
+          if (!is_alive) {
+            peer->is_closed = true;
+            closed.push_back(peer);
+            break;
           }
         }
+      }
 
-        std::list<int32_t> client_sockets;
-        {
-          std::lock_guard<std::mutex> lock(clients_mutex_);
-          for (int32_t client_socket : client_sockets_) {
-            client_sockets.push_back(client_socket);
+      // one send per client and pass keeps clients in step, frames compressed for one are reused by the next
+      for (bool is_progress = true; is_progress;) {
+        is_progress = false;
+        for (Peer *peer : peers) {
+          bool is_sent = false;
+          if (peer->is_closed) {
+            continue;
           }
+          if (!flush_(sender, peer, heads, &is_sent)) {
+            peer->is_closed = true;
+            closed.push_back(peer);
+            continue;
+          }
+          is_progress |= is_sent;
+        }
+        if (sender->in_flight > 0) {
+          is_progress |= complete_all_(sender);
         }
+      }
+      closed.insert(closed.end(), sender->failed.begin(), sender->failed.end());
+      sender->failed.clear();
 
-        Message *msg = reinterpret_cast<Message *>(const_cast<char *>(message.c_str()));
-        send_bytes += message.size();
-        msg->body.index = index_++;
-        msg->body.send_timestamp = Message::timestamp_us() - msg->body.generate_timestamp;
-        msg->body.send_bytes = send_bytes;
-        for (auto it = client_sockets.begin(); it != client_sockets.end();) {
-          const int32_t client_socket = *it;
-          const ssize_t length = message.size();
-          const bool is_alive = (send(client_socket, message.c_str(), length, MSG_NOSIGNAL) == length);
-          if (!is_alive) {
-            close(client_socket);
-            {
-              std::lock_guard<std::mutex> lock(clients_mutex_);
-              client_sockets_.erase(client_socket);
-            }
-            it = client_sockets.erase(it);
-            Log::debug("Client disconnected, socket: %d, client count: %lu", client_socket, client_sockets.size());
-          } else {
-            ++it;
+      for (Peer *peer : peers) {
+        if (peer->is_closed) {
+          continue;
+        }
+        bool has_data = !peer->pending.empty();
+        for (const Subscription &subscription : peer->subscriptions) {
+          const uint64_t head = heads[subscription.channel->id];
+          const bool is_lingering = subscription.linger_deadline != 0 && subscription.cursor < head;
+          has_data |= !is_lingering && subscription.cursor < head;
+          if (is_lingering) {
+            deadline = std::min(deadline, subscription.linger_deadline);
           }
-          Log::debug("Send %lu Bytes, curernt %ld", send_bytes, length);
         }
+        has_work |= peer->is_writable && has_data;
+        is_waiting |= peer->is_writable;
+        if (peer->is_greeting) {
+          deadline = std::min(deadline, peer->greeting_deadline);
+        }
+      }
+      for (Peer *peer : closed) {
+        disconnect_(sender, peer);
+      }
+      if (senders_.size() > 1 && !sender->is_changed) {
+        rebalance_(sender, peers);
+      }
 
-        // notify sender
-        messages_condition_.notify_one();
+      // only ask the producers for a wakeup when some client is ready to take the data
+      bool is_armed = true;
+      if (is_waiting && !has_work) {
+        for (const auto &channel : channels_) {
+          is_armed &= channel->ring.arm(heads[channel->id], sender->index);
+        }
       }
-    });
+      timeout_ms = (has_work || !closed.empty() || sender->is_changed || !is_armed) ? 0 : 500;
+      if (deadline != INT64_MAX) {
+        // rounded up to epoll's milliseconds, new data wakes the loop earlier through the ring
+        const int64_t remaining_ms = (deadline - Message::timestamp_us() + 999) / 1000;
+        timeout_ms = std::max<int64_t>(0, std::min<int64_t>(timeout_ms, remaining_ms));
+      }
+    }
   }
 
  private:
+  const ServerOptions options_;
+  // payload of the largest frame, a record larger than max_bytes goes out alone
+  const uint32_t max_frame_bytes_;
   uint16_t port_;
   int32_t server_socket_;
-  std::unordered_set<int32_t> client_sockets_;
 
-  bool stop_{false};
-  std::mutex messages_mutex_;
-  std::condition_variable messages_condition_;
-  std::thread server_thread_;
+  std::atomic<bool> stop_{false};
+
+  int32_t multicast_socket_{-1};
+  struct sockaddr_in multicast_address_ = {};
+  std::thread multicast_thread_;
+  std::atomic<uint64_t> multicast_bytes_{0};
+  std::atomic<uint64_t> multicast_datagrams_{0};
+  // sends that failed, their records reach clients only through gap fetches
+  std::atomic<uint64_t> multicast_errors_{0};
+
+  std::unique_ptr<Shm> shm_;
+  std::thread shm_thread_;
+  std::atomic<uint64_t> shm_records_{0};
 
   std::mutex clients_mutex_;
-  std::condition_variable clients_condition_;
   std::thread client_thread_;
+  std::unordered_map<int32_t, std::unique_ptr<Peer>> clients_;
+
+  std::vector<std::unique_ptr<Channel>> channels_;
+
+  // compiled filters by spec, alive as long as a client uses them
+  std::mutex filters_mutex_;
+  std::unordered_map<std::string, std::weak_ptr<const Filter>> filters_;
+  uint64_t filter_ids_{0};
 
-  std::list<std::string> messages_;
+  // input rate windows, see measure_rate_
+  inline static const int64_t kRateWindowUs = 1000;
+  std::vector<std::unique_ptr<Sender>> senders_;
 
-  uint64_t index_{0};
+  std::atomic<uint64_t> send_bytes_{0};
+  std::atomic<uint64_t> frames_{0};
+  std::atomic<uint64_t> client_count_{0};
+  std::atomic<uint64_t> drop_records_{0};
+  std::atomic<uint64_t> lag_drops_{0};
+  std::atomic<uint64_t> lag_disconnects_{0};
+  // payload bytes client filters held back
+  std::atomic<uint64_t> filter_drops_{0};
+  // from reading a line to handing its frame to the socket
+  Hist send_delay_us_hist_{"send_delay_us"};
+  // records a client was behind when a frame was cut
+  Hist queue_depth_hist_{"queue_depth"};
+  Hist batch_records_hist_{"batch_records"};
+  Hist batch_bytes_hist_{"batch_bytes"};
+  Hist batch_frames_hist_{"batch_frames"};
+  // how long small batches were held back waiting for more data
+  Hist linger_us_hist_{"linger_us"};
+  std::atomic<uint64_t> target_bytes_{0};
+  // last, so its final dump still sees everything above
+  Stats stats_;
 };
 
 #endif  // CHANNEL_SERVER_H
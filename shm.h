@@ -0,0 +1,327 @@
+#ifndef CHANNEL_SHM_H
+#define CHANNEL_SHM_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "utils.h"
+
+// Every channel of a server in one shared memory object, for clients on the same host. The server copies each
+// record in once however many clients map it, they map it read-only and follow with cursors of their own, woken
+// through a futex in the object. A client cannot hold the writer back: what it did not read before the writer
+// needed the space is lost, it notices by the channel's tail passing its cursor.
+class Shm {
+ public:
+  struct Record {
+    int64_t generate_timestamp{0};
+    uint64_t position{0};
+    uint32_t length{0};
+    uint32_t reserved{0};
+  };
+
+  // Whether a live server has `name`, one that exited closed it and the process of one that died is gone.
+  static bool is_in_use(const std::string &name) {
+    const int32_t fd = shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat status;
+    const bool is_sized = fstat(fd, &status) == 0 && static_cast<size_t>(status.st_size) >= sizeof(Header);
+    void *base = is_sized ? mmap(nullptr, sizeof(Header), PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (base == MAP_FAILED) {
+      return false;
+    }
+    const Header *header = static_cast<const Header *>(base);
+    const bool is_in_use = __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) == kShmMagic &&
+                           header->is_closed.load(std::memory_order_acquire) == 0 &&
+                           (kill(header->owner_pid, 0) == 0 || errno == EPERM);
+    munmap(base, sizeof(Header));
+    return is_in_use;
+  }
+
+  // Create `name` for `channels` with `bytes` of payload each, replacing what a server that is gone left there.
+  // Returns nullptr on failure, or if a live server has the name.
+  static std::unique_ptr<Shm> create(const std::string &name, const std::vector<std::string> &channels,
+                                     uint64_t bytes) {
+    if (channels.empty() || channels.size() > kMaxChannels || (bytes & (bytes - 1)) != 0 || is_in_use(name)) {
+      return nullptr;
+    }
+    const uint64_t records = bytes / kAverageRecordSize;
+    const uint64_t channel_size = records * sizeof(Record) + bytes;
+    std::unique_ptr<Shm> shm(new Shm());
+    shm->name_ = name;
+    shm->size_ = sizeof(Header) + channels.size() * channel_size;
+    shm_unlink(name.c_str());
+    const int32_t fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      return nullptr;
+    }
+    shm->is_owner_ = true;
+    const bool is_sized = ftruncate(fd, shm->size_) == 0;
+    void *base = is_sized ? mmap(nullptr, shm->size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (base == MAP_FAILED) {
+      return nullptr;
+    }
+    shm->base_ = static_cast<char *>(base);
+    Header *header = shm->header_();
+    header->version = kShmVersion;
+    header->owner_pid = getpid();
+    header->channel_count = channels.size();
+    for (size_t i = 0; i < channels.size(); ++i) {
+      Channel &channel = header->channels[i];
+      strncpy(channel.name, channels[i].c_str(), sizeof(channel.name) - 1);
+      channel.offset = sizeof(Header) + i * channel_size;
+      channel.records_capacity = records;
+      channel.bytes_capacity = bytes;
+    }
+    // clients check it last
+    __atomic_store_n(&header->magic, kShmMagic, __ATOMIC_RELEASE);
+    return shm;
+  }
+
+  // Map what a server created, read-only. Returns nullptr if there is none.
+  static std::unique_ptr<Shm> open(const std::string &name) {
+    const int32_t fd = shm_open(name.c_str(), O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) {
+      return nullptr;
+    }
+    struct stat status;
+    std::unique_ptr<Shm> shm(new Shm());
+    shm->name_ = name;
+    shm->size_ = (fstat(fd, &status) == 0) ? status.st_size : 0;
+    void *base = (shm->size_ >= sizeof(Header)) ? mmap(nullptr, shm->size_, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (base == MAP_FAILED) {
+      return nullptr;
+    }
+    shm->base_ = static_cast<char *>(base);
+    const Header *header = shm->header_();
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != kShmMagic || header->version != kShmVersion ||
+        header->channel_count > kMaxChannels) {
+      return nullptr;
+    }
+    return shm;
+  }
+
+  // The writer marks the object closed and removes its name, mapped clients read what is left.
+  ~Shm() {
+    if (base_ != nullptr && is_owner_) {
+      header_()->is_closed.store(1, std::memory_order_release);
+      notify();
+    }
+    if (base_ != nullptr) {
+      munmap(base_, size_);
+    }
+    if (is_owner_) {
+      shm_unlink(name_.c_str());
+    }
+  }
+
+  Shm(const Shm &) = delete;
+  Shm &operator=(const Shm &) = delete;
+
+  // writer side
+
+  // Append one record of the `count` pieces in `iov` to a channel, reclaiming the oldest records for the space.
+  // Clients only see it after notify().
+  void write(uint32_t index, const struct iovec *iov, int32_t count, int64_t generate_timestamp) {
+    Channel &channel = header_()->channels[index];
+    uint64_t size = 0;
+    for (int32_t i = 0; i < count; ++i) {
+      size += iov[i].iov_len;
+    }
+    if (size > channel.bytes_capacity) {
+      return;
+    }
+    Record *records = records_(channel);
+    const uint64_t head = channel.head.load(std::memory_order_relaxed);
+    const uint64_t old_tail = channel.tail.load(std::memory_order_relaxed);
+    uint64_t tail = old_tail;
+    while (tail < head && (head - tail >= channel.records_capacity ||
+                           channel.written + size - records[tail % channel.records_capacity].position >
+                               channel.bytes_capacity)) {
+      ++tail;
+    }
+    if (tail != old_tail) {
+      // readers check the tail after copying, it has to move before the bytes are overwritten
+      channel.tail.store(tail, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+    }
+    char *bytes = bytes_(channel);
+    uint64_t position = channel.written;
+    for (int32_t i = 0; i < count; ++i) {
+      const char *data = static_cast<const char *>(iov[i].iov_base);
+      const uint64_t offset = position & (channel.bytes_capacity - 1);
+      const uint64_t first = std::min<uint64_t>(iov[i].iov_len, channel.bytes_capacity - offset);
+      memcpy(bytes + offset, data, first);
+      memcpy(bytes, data + first, iov[i].iov_len - first);
+      position += iov[i].iov_len;
+    }
+    Record &record = records[head % channel.records_capacity];
+    record.generate_timestamp = generate_timestamp;
+    record.position = channel.written;
+    record.length = size;
+    channel.written = position;
+    channel.head.store(head + 1, std::memory_order_release);
+  }
+
+  // Wake every waiting client, one system call however many there are.
+  void notify() {
+    Header *header = header_();
+    header->futex.fetch_add(1, std::memory_order_release);
+    syscall(SYS_futex, &header->futex, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+  }
+
+  // reader side
+
+  // Index of the channel called `name`, -1 if there is none.
+  int32_t find(const std::string &name) const {
+    const Header *header = header_();
+    for (uint32_t i = 0; i < header->channel_count; ++i) {
+      if (name == header->channels[i].name) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  uint64_t head(uint32_t index) const { return header_()->channels[index].head.load(std::memory_order_acquire); }
+  uint64_t tail(uint32_t index) const { return header_()->channels[index].tail.load(std::memory_order_acquire); }
+  bool is_closed() const { return header_()->is_closed.load(std::memory_order_acquire) != 0; }
+
+  // Where to start for the last `bytes` of payload a channel still has, whole records only.
+  uint64_t rewind(uint32_t index, uint64_t bytes) const {
+    const Channel &channel = header_()->channels[index];
+    const Record *table = records_(channel);
+    const uint64_t head = channel.head.load(std::memory_order_acquire);
+    uint64_t seq = head;
+    uint64_t size = 0;
+    while (seq > channel.tail.load(std::memory_order_acquire)) {
+      size += table[(seq - 1) % channel.records_capacity].length;
+      if (size > bytes) {
+        break;
+      }
+      --seq;
+    }
+    // what was reclaimed meanwhile read() skips and counts
+    return seq;
+  }
+
+  // Taken before reading, wait() returns as soon as anything was written after it.
+  uint32_t sequence() const { return header_()->futex.load(std::memory_order_acquire); }
+
+  void wait(uint32_t sequence, int64_t timeout_ms) const {
+    struct timespec timeout = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000};
+    syscall(SYS_futex, &header_()->futex, FUTEX_WAIT, sequence, &timeout, nullptr, 0);
+  }
+
+  // Copy the records of a channel from `cursor` on to `out`, as many as fit in `capacity` bytes, at least
+  // kMaxMessageLength, and their lengths and timestamps to `records`. Returns the bytes copied and moves `cursor`
+  // past them. Records reclaimed before they were read are skipped and added to `lost`.
+  size_t read(uint32_t index, uint64_t *cursor, char *out, size_t capacity, std::vector<IndexEntry> *records,
+              uint64_t *lost) const {
+    const Channel &channel = header_()->channels[index];
+    const Record *table = records_(channel);
+    const char *bytes = bytes_(channel);
+    const uint64_t head = channel.head.load(std::memory_order_acquire);
+    while (true) {
+      const uint64_t tail = channel.tail.load(std::memory_order_acquire);
+      if (*cursor < tail) {
+        *lost += tail - *cursor;
+        *cursor = tail;
+      }
+      records->clear();
+      size_t size = 0;
+      uint64_t seq = *cursor;
+      for (; seq < head; ++seq) {
+        const Record record = table[seq % channel.records_capacity];
+        // a record overwritten under the copy may read as anything, the tail check below throws it away
+        if (record.length > kMaxMessageLength || size + record.length > capacity) {
+          break;
+        }
+        const uint64_t offset = record.position & (channel.bytes_capacity - 1);
+        const uint64_t first = std::min<uint64_t>(record.length, channel.bytes_capacity - offset);
+        memcpy(out + size, bytes + offset, first);
+        memcpy(out + size + first, bytes, record.length - first);
+        records->push_back({record.length, record.generate_timestamp});
+        size += record.length;
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (channel.tail.load(std::memory_order_relaxed) <= *cursor) {
+        *cursor = seq;
+        return size;
+      }
+    }
+  }
+
+ private:
+  inline static const uint64_t kShmMagic = 0x6d68732d6c6e6863;  // "chnl-shm"
+  inline static const uint32_t kShmVersion = 1;
+  // records per channel are its bytes over this, as in the server's rings
+  inline static const uint64_t kAverageRecordSize = 64;
+
+  // Positions only grow, the masked value is the offset. Only the writer changes anything.
+  struct Channel {
+    char name[64];
+    // of its record table, its bytes follow
+    uint64_t offset;
+    uint64_t records_capacity;
+    uint64_t bytes_capacity;
+    // records written, and the oldest one whose bytes are still intact
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    // where the next record's bytes go
+    uint64_t written;
+  };
+
+  struct Header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t channel_count;
+    // bumped with every notify(), clients wait on it
+    std::atomic<uint32_t> futex;
+    std::atomic<uint32_t> is_closed;
+    // the server's, to tell a live one from one that died without closing
+    int32_t owner_pid;
+    uint32_t reserved;
+    Channel channels[kMaxChannels];
+  };
+  static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+                "shared counters need lock free atomics");
+
+  Shm() = default;
+
+  Header *header_() const { return reinterpret_cast<Header *>(base_); }
+  Record *records_(const Channel &channel) const { return reinterpret_cast<Record *>(base_ + channel.offset); }
+  char *bytes_(const Channel &channel) const {
+    return base_ + channel.offset + channel.records_capacity * sizeof(Record);
+  }
+
+  std::string name_{""};
+  char *base_{nullptr};
+  size_t size_{0};
+  // created it, so closes and removes it
+  bool is_owner_{false};
+};
+
+#endif  // CHANNEL_SHM_H
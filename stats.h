@@ -0,0 +1,114 @@
+#ifndef CHANNEL_STATS_H
+#define CHANNEL_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "utils.h"
+
+// Dumps registered counters and histograms as one JSON line on stderr, every interval and whenever SIGUSR1 asks
+// for it. Recording stays on the data path's own atomics, the dump runs on a thread of its own.
+class Stats {
+ public:
+  Stats(const std::string &side, int64_t interval_ms) : side_(side), interval_ms_(interval_ms) {}
+
+  ~Stats() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    condition_.notify_all();
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+    if (interval_ms_ > 0) {
+      dump();
+    }
+  }
+
+  Stats(const Stats &) = delete;
+  Stats &operator=(const Stats &) = delete;
+
+  // Register before start(), the pointees have to outlive this object.
+  void add(const Hist *hist) { hists_.push_back(hist); }
+  void add(const std::string &name, const std::atomic<uint64_t> *counter) { counters_.emplace_back(name, counter); }
+  void add(const std::string &name, const std::atomic<int64_t> *gauge) { gauges_.emplace_back(name, gauge); }
+  // a fixed string next to the side, to tell apart several dumps of one side
+  void tag(const std::string &name, const std::string &value) { tags_.emplace_back(name, value); }
+
+  void start() {
+    answered_ = requests_.load();
+    thread_ = std::thread([this]() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      auto next = std::chrono::steady_clock::now() + std::chrono::milliseconds(interval_ms_);
+      while (!stop_) {
+        condition_.wait_for(lock, std::chrono::milliseconds(kPollMs));
+        const bool is_due = interval_ms_ > 0 && std::chrono::steady_clock::now() >= next;
+        if (is_due) {
+          next += std::chrono::milliseconds(interval_ms_);
+        }
+        // every instance answers a request, each keeps track of which ones it answered
+        const uint64_t requests = requests_.load();
+        if (is_due || requests != answered_) {
+          answered_ = requests;
+          dump();
+        }
+      }
+    });
+  }
+
+  // SIGUSR1 handler, only bumps a counter.
+  static void request(int32_t) { ++requests_; }
+
+  void dump() const {
+    std::string line = "{\"side\":\"" + side_ + "\"";
+    for (const auto &[name, value] : tags_) {
+      line += ",\"" + name + "\":\"" + value + "\"";
+    }
+    line += ",\"timestamp_us\":" + std::to_string(Message::timestamp_us());
+    line += ",\"counters\":{";
+    for (size_t i = 0; i < counters_.size(); ++i) {
+      line += (i > 0 ? ",\"" : "\"") + counters_[i].first + "\":" + std::to_string(counters_[i].second->load());
+    }
+    for (size_t i = 0; i < gauges_.size(); ++i) {
+      const bool is_first = (i == 0 && counters_.empty());
+      line += (is_first ? "\"" : ",\"") + gauges_[i].first + "\":" + std::to_string(gauges_[i].second->load());
+    }
+    line += "},\"hists\":{";
+    for (size_t i = 0; i < hists_.size(); ++i) {
+      line += (i > 0 ? ",\"" : "\"") + hists_[i]->name() + "\":" + hists_[i]->snapshot().to_json();
+    }
+    line += "}}\n";
+    fputs(line.c_str(), stderr);
+  }
+
+ private:
+  inline static const int64_t kPollMs = 100;
+  inline static std::atomic<uint64_t> requests_{0};
+
+  const std::string side_;
+  const int64_t interval_ms_;
+  std::vector<const Hist *> hists_;
+  std::vector<std::pair<std::string, const std::atomic<uint64_t> *>> counters_;
+  // signed values, dumped with the counters
+  std::vector<std::pair<std::string, const std::atomic<int64_t> *>> gauges_;
+  std::vector<std::pair<std::string, std::string>> tags_;
+
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  bool stop_{false};
+  std::thread thread_;
+  // requests_ as of the last dump, only the dump thread touches it
+  uint64_t answered_{0};
+};
+
+#endif  // CHANNEL_STATS_H
@@ -0,0 +1,205 @@
+#ifndef CHANNEL_URING_H
+#define CHANNEL_URING_H
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+
+// Just enough io_uring for batched socket I/O, straight on the system calls. create() returns nullptr when the
+// kernel cannot do it, too old or io_uring turned off, and the caller stays with epoll. One thread owns a ring.
+class Uring {
+ public:
+  static std::unique_ptr<Uring> create(uint32_t entries) {
+    std::unique_ptr<Uring> uring(new Uring());
+    if (!uring->setup_(entries)) {
+      return nullptr;
+    }
+    return uring;
+  }
+
+  ~Uring() {
+    if (sqes_ != MAP_FAILED) {
+      munmap(sqes_, sqes_size_);
+    }
+    if (rings_ != MAP_FAILED) {
+      munmap(rings_, rings_size_);
+    }
+    if (fd_ >= 0) {
+      close(fd_);
+    }
+  }
+
+  Uring(const Uring &) = delete;
+  Uring &operator=(const Uring &) = delete;
+
+  // The prep calls queue one request, returning false when the submission queue is full. Nothing reaches the kernel
+  // before submit(), the memory a request points at has to stay put until its completion is reaped.
+  bool sendmsg(int32_t fd, const struct msghdr *msg, uint32_t flags, uint64_t user_data) {
+    struct io_uring_sqe *sqe = sqe_(IORING_OP_SENDMSG, fd, user_data);
+    if (sqe == nullptr) {
+      return false;
+    }
+    sqe->addr = reinterpret_cast<uint64_t>(msg);
+    sqe->len = 1;
+    sqe->msg_flags = flags;
+    return true;
+  }
+
+  // Stays armed, every connection is one completion with IORING_CQE_F_MORE set as long as more will follow.
+  bool accept_multishot(int32_t fd, uint32_t flags, uint64_t user_data) {
+    struct io_uring_sqe *sqe = sqe_(IORING_OP_ACCEPT, fd, user_data);
+    if (sqe == nullptr) {
+      return false;
+    }
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = flags;
+    return true;
+  }
+
+  // Read into the registered buffer, `data` lies within it.
+  bool read_fixed(int32_t fd, char *data, size_t size, uint64_t user_data) {
+    struct io_uring_sqe *sqe = sqe_(IORING_OP_READ_FIXED, fd, user_data);
+    if (sqe == nullptr) {
+      return false;
+    }
+    sqe->addr = reinterpret_cast<uint64_t>(data);
+    sqe->len = size;
+    sqe->buf_index = 0;
+    return true;
+  }
+
+  // Pin `size` bytes at `data` as buffer 0 for read_fixed(), so the kernel maps them once rather than per read.
+  bool register_buffer(char *data, size_t size) {
+    if (is_registered_) {
+      syscall(__NR_io_uring_register, fd_, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+      is_registered_ = false;
+    }
+    struct iovec iov = {data, size};
+    is_registered_ = syscall(__NR_io_uring_register, fd_, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+    return is_registered_;
+  }
+
+  // Hand the queued requests to the kernel and wait until `wait` completions are there, or `timeout_us` passed when
+  // it is not negative. One system call either way. Returns 0 or the negated errno, -ETIME for the timeout.
+  int32_t submit(uint32_t wait, int64_t timeout_us = -1) {
+    const uint32_t queued = sq_tail_ - submitted_;
+    __atomic_store_n(sq_ktail_, sq_tail_, __ATOMIC_RELEASE);
+    uint32_t flags = (wait > 0) ? IORING_ENTER_GETEVENTS : 0;
+    struct __kernel_timespec timeout = {timeout_us / 1000000, (timeout_us % 1000000) * 1000};
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    arg.ts = reinterpret_cast<uint64_t>(&timeout);
+    const bool has_timeout = wait > 0 && timeout_us >= 0;
+    if (has_timeout) {
+      flags |= IORING_ENTER_EXT_ARG;
+    }
+    const long result = syscall(__NR_io_uring_enter, fd_, queued, wait, flags, has_timeout ? &arg : nullptr,
+                                has_timeout ? sizeof(arg) : 0);
+    if (result < 0) {
+      return -errno;
+    }
+    submitted_ += result;
+    return 0;
+  }
+
+  // Call `handler(user_data, res, flags)` for every completion there is, returns how many there were.
+  template <typename Handler> uint32_t reap(Handler &&handler) {
+    uint32_t head = *cq_khead_;
+    const uint32_t tail = __atomic_load_n(cq_ktail_, __ATOMIC_ACQUIRE);
+    const uint32_t count = tail - head;
+    for (; head != tail; ++head) {
+      const struct io_uring_cqe &cqe = cqes_[head & cq_mask_];
+      handler(cqe.user_data, cqe.res, cqe.flags);
+    }
+    __atomic_store_n(cq_khead_, head, __ATOMIC_RELEASE);
+    return count;
+  }
+
+ private:
+  Uring() = default;
+
+  bool setup_(uint32_t entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    fd_ = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd_ < 0) {
+      return false;
+    }
+    // 5.11 and later, older kernels are left to epoll rather than worked around
+    const uint32_t features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG;
+    if ((params.features & features) != features) {
+      return false;
+    }
+    rings_size_ = std::max(params.sq_off.array + params.sq_entries * sizeof(uint32_t),
+                           params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+    rings_ = mmap(nullptr, rings_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = static_cast<struct io_uring_sqe *>(
+        mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES));
+    if (rings_ == MAP_FAILED || sqes_ == MAP_FAILED) {
+      return false;
+    }
+    char *rings = static_cast<char *>(rings_);
+    sq_khead_ = reinterpret_cast<uint32_t *>(rings + params.sq_off.head);
+    sq_ktail_ = reinterpret_cast<uint32_t *>(rings + params.sq_off.tail);
+    sq_array_ = reinterpret_cast<uint32_t *>(rings + params.sq_off.array);
+    sq_mask_ = *reinterpret_cast<uint32_t *>(rings + params.sq_off.ring_mask);
+    sq_entries_ = params.sq_entries;
+    sq_tail_ = *sq_ktail_;
+    submitted_ = sq_tail_;
+    cq_khead_ = reinterpret_cast<uint32_t *>(rings + params.cq_off.head);
+    cq_ktail_ = reinterpret_cast<uint32_t *>(rings + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<uint32_t *>(rings + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe *>(rings + params.cq_off.cqes);
+    return true;
+  }
+
+  // Next free submission entry, cleared, or nullptr when the queue is full.
+  struct io_uring_sqe *sqe_(uint8_t opcode, int32_t fd, uint64_t user_data) {
+    if (sq_tail_ - __atomic_load_n(sq_khead_, __ATOMIC_ACQUIRE) >= sq_entries_) {
+      return nullptr;
+    }
+    const uint32_t index = sq_tail_ & sq_mask_;
+    struct io_uring_sqe *sqe = &sqes_[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    sq_array_[index] = index;
+    ++sq_tail_;
+    return sqe;
+  }
+
+ private:
+  int32_t fd_{-1};
+  void *rings_{MAP_FAILED};
+  size_t rings_size_{0};
+  struct io_uring_sqe *sqes_{static_cast<struct io_uring_sqe *>(MAP_FAILED)};
+  size_t sqes_size_{0};
+  bool is_registered_{false};
+
+  // the k pointers are shared with the kernel, sq_tail_ is what was queued here and submitted_ what it was told of
+  uint32_t *sq_khead_{nullptr};
+  uint32_t *sq_ktail_{nullptr};
+  uint32_t *sq_array_{nullptr};
+  uint32_t sq_mask_{0};
+  uint32_t sq_entries_{0};
+  uint32_t sq_tail_{0};
+  uint32_t submitted_{0};
+  uint32_t *cq_khead_{nullptr};
+  uint32_t *cq_ktail_{nullptr};
+  uint32_t cq_mask_{0};
+  struct io_uring_cqe *cqes_{nullptr};
+};
+
+#endif  // CHANNEL_URING_H
@@ -4,21 +4,49 @@
 #include "config.h"
 #include "log.h"
 
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
 #include <algorithm>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <string>
+#include <unordered_map>
 #include <vector>
 
-inline const union {
+union WireVersion {
   uint32_t version;
   struct {
     uint8_t patch;
     uint8_t minor;
     uint8_t major;
   } detail;
-} kVersion{.detail = {
-               .patch = 1,
-               .minor = 1,
-               .major = 0,
-           }};
+};
+
+// v1, a Message header
+inline const WireVersion kVersion{.detail = {
+                                      .patch = 1,
+                                      .minor = 1,
+                                      .major = 0,
+                                  }};
+
+// v2, a MessageV2 header, sent to clients whose hello has "wire=2"
+inline const WireVersion kVersion2{.detail = {
+                                       .patch = 0,
+                                       .minor = 2,
+                                       .major = 0,
+                                   }};
+
+// largest payload a single Message can describe, see Message::body.length. Records never exceed it, so any record
+// fits a v1 frame.
+inline const uint32_t kMaxMessageLength = (1u << 16) - 1;
+// largest payload of a MessageV2 frame
+inline const uint32_t kMaxFrameLength = 1u << 20;
 
 struct Message {
   struct {
@@ -43,46 +71,650 @@ struct Message {
     clock_gettime(CLOCK_REALTIME, &ts);
     return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
   }
+
+  // for intervals, never steps
+  static int64_t steady_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+};
+
+// Optional fields after Message, present when Message::header.size covers them. They are only sent to clients
+// that asked for them in their hello, so older clients keep seeing plain Messages.
+struct __attribute__((packed)) MessageExt {
+  uint32_t flags{0};
+  // payload length once inflated
+  uint32_t raw_length{0};
+  // the server channel the frame belongs to, ids are announced in the hello answering a subscription
+  uint32_t channel{0};
+};
+
+enum MessageFlag : uint32_t {
+  // client options or server answers, the payload holds "key=value" lines
+  kFlagHello = 1u << 0,
+  // payload is Lz compressed
+  kFlagCompressed = 1u << 1,
+  // clock probe from a client, generate_timestamp is when it was sent
+  kFlagPing = 1u << 2,
+  // answer to a ping, generate_timestamp echoes it and the payload holds "receive" and "hold" in microseconds
+  kFlagPong = 1u << 3,
+  // v2 only, MessageV2::checksum holds the CRC-32C of the payload as sent
+  kFlagChecksum = 1u << 4,
+  // v2 only, the payload starts with the record index, see decode_index. Compression applies to what follows it.
+  kFlagIndex = 1u << 5,
+  // multicast only, the payload is the next piece of one record too long for a datagram and raw_length is the
+  // record's whole length. The pieces go out in order, all with the record's index.
+  kFlagFragment = 1u << 6,
+};
+
+// The v2 header: the first word as in Message, so a reader tells the versions apart, then 32 bit lengths and the
+// MessageExt fields, always present. MessageRelay and MessageRange follow when header.size covers them.
+struct __attribute__((packed)) MessageV2 {
+  struct {
+    uint32_t version : 24;
+    uint32_t size : 8;
+  } header = {
+      .version = kVersion2.version,
+      .size = sizeof(MessageV2),
+  };
+  uint32_t flags{0};
+  uint32_t length{0};
+  uint32_t raw_length{0};
+  uint32_t channel{0};
+  uint32_t checksum{0};
+  int64_t generate_timestamp{0};
+  int32_t send_timestamp{0};
+  uint32_t index{0};
+  uint64_t send_bytes{0};
+};
+
+// After MessageExt for data that came through relays, only sent to clients whose hello has "hops=1".
+struct __attribute__((packed)) MessageRelay {
+  // relays the data passed, generate_timestamp stays the one of the server that read it first
+  uint32_t hops{0};
+  // when the last relay received it, the latency of the last hop is measured from here
+  int64_t relay_timestamp{0};
+};
+
+// After MessageRelay on multicast datagrams. They can get lost, with the record count a client knows where the next
+// frame of the channel has to start, body.index + records.
+struct __attribute__((packed)) MessageRange {
+  uint32_t records{0};
+};
+
+// What a frame header carries beyond the basic fields, each level includes the ones before.
+enum FrameFields : int32_t {
+  kFieldsBasic = 0,
+  // MessageExt in v1, always there in v2
+  kFieldsChannel = 1,
+  kFieldsRelay = 2,
+  kFieldsRange = 3,
+};
+
+// A frame of either version as both ends handle it, the wire format is only seen by encode_frame and decode_frame.
+// Fields the header does not carry read as 0.
+struct Frame {
+  uint32_t version{kVersion.version};
+  FrameFields fields{kFieldsBasic};
+  uint32_t flags{0};
+  uint32_t length{0};
+  uint32_t raw_length{0};
+  uint32_t channel{0};
+  uint32_t checksum{0};
+  int64_t generate_timestamp{0};
+  int32_t send_timestamp{0};
+  uint32_t index{0};
+  uint64_t send_bytes{0};
+  uint32_t hops{0};
+  int64_t relay_timestamp{0};
+  uint32_t records{0};
+};
+
+inline uint32_t frame_header_size(uint32_t version, FrameFields fields) {
+  uint32_t size = (version == kVersion2.version) ? sizeof(MessageV2) : sizeof(Message);
+  if (version != kVersion2.version && fields >= kFieldsChannel) {
+    size += sizeof(MessageExt);
+  }
+  if (fields >= kFieldsRelay) {
+    size += sizeof(MessageRelay);
+  }
+  if (fields >= kFieldsRange) {
+    size += sizeof(MessageRange);
+  }
+  return size;
+}
+
+// largest header either version has
+inline constexpr uint32_t kMaxFrameHeaderSize =
+    std::max(sizeof(Message) + sizeof(MessageExt), sizeof(MessageV2)) + sizeof(MessageRelay) + sizeof(MessageRange);
+
+// Write the header of `frame` to `out`, which holds kMaxFrameHeaderSize bytes. Returns its size. A v1 frame cannot
+// describe more than kMaxMessageLength payload bytes, the caller keeps to that.
+inline uint32_t encode_frame(const Frame &frame, char *out) {
+  const uint32_t size = frame_header_size(frame.version, frame.fields);
+  char *extensions = out;
+  if (frame.version == kVersion2.version) {
+    MessageV2 msg;
+    msg.header.size = size;
+    msg.flags = frame.flags;
+    msg.length = frame.length;
+    msg.raw_length = frame.raw_length;
+    msg.channel = frame.channel;
+    msg.checksum = frame.checksum;
+    msg.generate_timestamp = frame.generate_timestamp;
+    msg.send_timestamp = frame.send_timestamp;
+    msg.index = frame.index;
+    msg.send_bytes = frame.send_bytes;
+    memcpy(out, &msg, sizeof(msg));
+    extensions += sizeof(msg);
+  } else {
+    Message msg;
+    msg.header.size = size;
+    msg.body.generate_timestamp = frame.generate_timestamp;
+    msg.body.send_timestamp = frame.send_timestamp;
+    msg.body.index = frame.index;
+    msg.body.send_bytes = frame.send_bytes;
+    msg.body.length = frame.length;
+    memcpy(out, &msg, sizeof(msg));
+    extensions += sizeof(msg);
+    if (frame.fields >= kFieldsChannel) {
+      const MessageExt ext = {frame.flags, frame.raw_length, frame.channel};
+      memcpy(extensions, &ext, sizeof(ext));
+      extensions += sizeof(ext);
+    }
+  }
+  if (frame.fields >= kFieldsRelay) {
+    const MessageRelay relay = {frame.hops, frame.relay_timestamp};
+    memcpy(extensions, &relay, sizeof(relay));
+    extensions += sizeof(relay);
+  }
+  if (frame.fields >= kFieldsRange) {
+    const MessageRange range = {frame.records};
+    memcpy(extensions, &range, sizeof(range));
+  }
+  return size;
+}
+
+// Read the header at `data`, of which `size` bytes are there. Returns the header size, 0 when more bytes are needed
+// and -1 for something that is not a frame header.
+inline int32_t decode_frame(const char *data, size_t size, Frame *frame) {
+  if (size < sizeof(uint32_t)) {
+    return 0;
+  }
+  Message msg;
+  memcpy(&msg.header, data, sizeof(msg.header));
+  const uint32_t header_size = msg.header.size;
+  const bool is_v2 = (msg.header.version == kVersion2.version);
+  if ((!is_v2 && msg.header.version != kVersion.version) ||
+      header_size < frame_header_size(msg.header.version, kFieldsBasic)) {
+    return -1;
+  }
+  if (size < header_size) {
+    return 0;
+  }
+  *frame = Frame();
+  frame->version = msg.header.version;
+  const char *extensions = data;
+  if (is_v2) {
+    MessageV2 v2;
+    memcpy(&v2, data, sizeof(v2));
+    frame->fields = kFieldsChannel;
+    frame->flags = v2.flags;
+    frame->length = v2.length;
+    frame->raw_length = v2.raw_length;
+    frame->channel = v2.channel;
+    frame->checksum = v2.checksum;
+    frame->generate_timestamp = v2.generate_timestamp;
+    frame->send_timestamp = v2.send_timestamp;
+    frame->index = v2.index;
+    frame->send_bytes = v2.send_bytes;
+    extensions += sizeof(v2);
+  } else {
+    memcpy(&msg, data, sizeof(msg));
+    frame->length = msg.body.length;
+    frame->generate_timestamp = msg.body.generate_timestamp;
+    frame->send_timestamp = msg.body.send_timestamp;
+    frame->index = msg.body.index;
+    frame->send_bytes = msg.body.send_bytes;
+    extensions += sizeof(msg);
+    if (header_size >= frame_header_size(frame->version, kFieldsChannel)) {
+      MessageExt ext;
+      memcpy(&ext, extensions, sizeof(ext));
+      frame->fields = kFieldsChannel;
+      frame->flags = ext.flags;
+      frame->raw_length = ext.raw_length;
+      frame->channel = ext.channel;
+      extensions += sizeof(ext);
+    }
+  }
+  if (header_size >= frame_header_size(frame->version, kFieldsRelay)) {
+    MessageRelay relay;
+    memcpy(&relay, extensions, sizeof(relay));
+    frame->fields = kFieldsRelay;
+    frame->hops = relay.hops;
+    frame->relay_timestamp = relay.relay_timestamp;
+    extensions += sizeof(relay);
+  }
+  if (header_size >= frame_header_size(frame->version, kFieldsRange)) {
+    MessageRange range;
+    memcpy(&range, extensions, sizeof(range));
+    frame->fields = kFieldsRange;
+    frame->records = range.records;
+  }
+  return header_size;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) inline uint32_t crc32c_sse42_(uint32_t crc, const char *data, size_t size) {
+  uint64_t value = crc;
+  for (; size >= sizeof(uint64_t); data += sizeof(uint64_t), size -= sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, data, sizeof(word));
+    value = __builtin_ia32_crc32di(value, word);
+  }
+  crc = value;
+  for (; size > 0; ++data, --size) {
+    crc = __builtin_ia32_crc32qi(crc, *data);
+  }
+  return crc;
+}
+#endif
+
+// CRC-32C of `size` bytes continuing from `crc`, 0 to start. With the SSE4.2 instruction where the CPU has it.
+inline uint32_t crc32c(uint32_t crc, const char *data, size_t size) {
+  crc = ~crc;
+#if defined(__x86_64__)
+  static const bool is_sse42 = __builtin_cpu_supports("sse4.2");
+  if (is_sse42) {
+    return ~crc32c_sse42_(crc, data, size);
+  }
+#endif
+  static const std::unique_ptr<uint32_t[]> table = []() {
+    std::unique_ptr<uint32_t[]> table = std::make_unique<uint32_t[]>(256);
+    for (uint32_t i = 0; i < 256; ++i) {
+      uint32_t value = i;
+      for (int32_t bit = 0; bit < 8; ++bit) {
+        value = (value >> 1) ^ ((value & 1) ? 0x82f63b78u : 0);
+      }
+      table[i] = value;
+    }
+    return table;
+  }();
+  for (; size > 0; ++data, --size) {
+    crc = table[(crc ^ static_cast<uint8_t>(*data)) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+// One record of a frame as its index describes it.
+struct IndexEntry {
+  uint32_t length{0};
+  int64_t generate_timestamp{0};
 };
 
-template <typename Tp> class Hist {
+// LEB128, 7 bits per byte and the high bit set on all but the last.
+inline void append_varint(std::string *out, uint64_t value) {
+  for (; value >= 0x80; value >>= 7) {
+    out->push_back(static_cast<char>((value & 0x7f) | 0x80));
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+// Returns the bytes read, 0 if `size` ends inside the value.
+inline size_t read_varint(const char *data, size_t size, uint64_t *value) {
+  *value = 0;
+  for (size_t i = 0; i < size && i < 10; ++i) {
+    *value |= static_cast<uint64_t>(data[i] & 0x7f) << (7 * i);
+    if ((data[i] & 0x80) == 0) {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+// the most bytes one record takes in an index, a 16 bit length and any timestamp difference
+inline const uint32_t kMaxIndexEntrySize = 3 + 10;
+
+// Per-record lengths and timestamps of a frame whose records were coalesced: the record count, then for each record
+// its length and the zigzag encoded difference of its generate_timestamp to the one before, the first to the
+// frame's. Two to four bytes per line. Appends to `out`.
+inline void encode_index(std::string *out, const IndexEntry *entries, size_t count, int64_t base) {
+  append_varint(out, count);
+  for (size_t i = 0; i < count; ++i) {
+    const int64_t delta = entries[i].generate_timestamp - base;
+    append_varint(out, entries[i].length);
+    append_varint(out, (static_cast<uint64_t>(delta) << 1) ^ static_cast<uint64_t>(delta >> 63));
+    base = entries[i].generate_timestamp;
+  }
+}
+
+// Read the index at the start of a payload of `size` bytes, `base` is the frame's generate_timestamp. Returns the
+// index size or -1 when it is broken.
+inline int32_t decode_index(const char *data, size_t size, int64_t base, std::vector<IndexEntry> *entries) {
+  entries->clear();
+  uint64_t count = 0;
+  size_t offset = read_varint(data, size, &count);
+  if (offset == 0 || count > size) {
+    return -1;
+  }
+  entries->resize(count);
+  for (IndexEntry &entry : *entries) {
+    uint64_t length = 0;
+    uint64_t delta = 0;
+    const size_t length_size = read_varint(data + offset, size - offset, &length);
+    const size_t delta_size = (length_size == 0) ? 0 : read_varint(data + offset + length_size,
+                                                                  size - offset - length_size, &delta);
+    if (delta_size == 0 || length > kMaxMessageLength) {
+      return -1;
+    }
+    offset += length_size + delta_size;
+    base += static_cast<int64_t>((delta >> 1) ^ (~(delta & 1) + 1));
+    entry.length = length;
+    entry.generate_timestamp = base;
+  }
+  return offset;
+}
+
+// Split "key=value" lines, unknown keys are left to the caller to ignore.
+inline std::unordered_map<std::string, std::string> parse_options(const char *data, size_t size) {
+  std::unordered_map<std::string, std::string> options;
+  const char *const end = data + size;
+  while (data < end) {
+    const char *line_end = static_cast<const char *>(memchr(data, '\n', end - data));
+    if (line_end == nullptr) {
+      line_end = end;
+    }
+    const char *equal = static_cast<const char *>(memchr(data, '=', line_end - data));
+    if (equal != nullptr) {
+      options[std::string(data, equal)] = std::string(equal + 1, line_end);
+    }
+    data = line_end + 1;
+  }
+  return options;
+}
+
+// write(2) until everything is out, returns false on error
+inline bool write_all(int32_t fd, const char *data, size_t size) {
+  while (size > 0) {
+    const ssize_t length = write(fd, data, size);
+    if (length < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    data += length;
+    size -= length;
+  }
+  return true;
+}
+
+// Collects output spans and hands them to the kernel with one writev.
+class Writer {
  public:
-  Hist(const std::string &name, const std::initializer_list<Tp> &hist_delimiters)
-      : name_(name), hist_delimiters_(hist_delimiters) {
-    hist_.resize(hist_delimiters.size() + 1);
+  Writer(int32_t fd) : fd_(fd) {}
+
+  // The data has to stay valid until the next flush.
+  void add(const char *data, size_t size) {
+    if (size == 0) {
+      return;
+    }
+    if (count_ == kMaxSpans) {
+      flush();
+    }
+    iov_[count_].iov_base = const_cast<char *>(data);
+    iov_[count_].iov_len = size;
+    ++count_;
+  }
+
+  // Like add() for short pieces the caller does not keep, they are copied. One that does not fit the scratch buffer
+  // at all is written out right away instead.
+  void copy(const char *data, size_t size) {
+    if (size > kScratchSize) {
+      add(data, size);
+      flush();
+      return;
+    }
+    if (count_ == kMaxSpans || scratch_size_ + size > kScratchSize) {
+      flush();
+    }
+    memcpy(scratch_ + scratch_size_, data, size);
+    add(scratch_ + scratch_size_, size);
+    scratch_size_ += size;
   }
 
-  void add(const Tp &value) {
-    auto it = std::lower_bound(hist_delimiters_.begin(), hist_delimiters_.end(), value);
-    ++hist_[it - hist_delimiters_.begin()];
+  bool flush() {
+    struct iovec *iov = iov_;
+    int32_t count = count_;
+    count_ = 0;
+    scratch_size_ = 0;
+    while (count > 0) {
+      const ssize_t length = writev(fd_, iov, count);
+      if (length < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      size_t skip = length;
+      while (count > 0 && skip >= iov->iov_len) {
+        skip -= iov->iov_len;
+        ++iov;
+        --count;
+      }
+      if (count > 0) {
+        iov->iov_base = static_cast<char *>(iov->iov_base) + skip;
+        iov->iov_len -= skip;
+      }
+    }
+    return true;
+  }
 
-    mean_ = (mean_ * count_ + value) / (count_ + 1);
-    count_ += 1;
-    min_ = std::min(min_, value);
-    max_ = std::max(max_, value);
+ private:
+  inline static const int32_t kMaxSpans = 1024;
+  inline static const size_t kScratchSize = 64 * 1024;
+
+  const int32_t fd_;
+  struct iovec iov_[kMaxSpans];
+  int32_t count_{0};
+  char scratch_[kScratchSize];
+  size_t scratch_size_{0};
+};
+
+// Reassembles frames from a stream socket. Reads take as much as the socket has, every complete frame in the
+// buffer is handed out in place and a trailing partial frame is carried over to the next read.
+class Receiver {
+ public:
+  Receiver(size_t capacity) : capacity_(capacity) { buffer_ = std::make_unique<char[]>(capacity_); }
+
+  // One read() into the free space, returns what read() returned.
+  ssize_t fill(int32_t fd) {
+    const ssize_t length = read(fd, buffer_.get() + size_, capacity_ - size_);
+    if (length > 0) {
+      size_ += length;
+    }
+    return length;
+  }
+
+  // The same for a read done elsewhere: it goes to space() and is taken in with commit().
+  char *space() { return buffer_.get() + size_; }
+  size_t space_size() const { return capacity_ - size_; }
+  void commit(size_t length) { size_ += length; }
+  // the whole buffer, to register it with the kernel
+  char *data() { return buffer_.get(); }
+  size_t capacity() const { return capacity_; }
+
+  // Next complete frame or nullptr, `payload` points at its body inside the buffer until compact(). The frame is
+  // valid until the next call.
+  const Frame *next(const char **payload) {
+    if (is_corrupt_) {
+      return nullptr;
+    }
+    const int32_t header_size = decode_frame(buffer_.get() + offset_, size_ - offset_, &frame_);
+    if (header_size < 0) {
+      Message msg;
+      memcpy(&msg.header, buffer_.get() + offset_, sizeof(msg.header));
+      const uint32_t version = msg.header.version;
+      const uint32_t size = msg.header.size;
+      Log::error("Invalid message version or size, version: %u vs %u or %u, size: %u", version, kVersion.version,
+                 kVersion2.version, size);
+      is_corrupt_ = true;
+      return nullptr;
+    }
+    if (header_size == 0) {
+      return nullptr;
+    }
+    const size_t frame_size = header_size + static_cast<size_t>(frame_.length);
+    if (frame_size > capacity_) {
+      Log::error("Message of %lu bytes exceeds the receive buffer", frame_size);
+      is_corrupt_ = true;
+      return nullptr;
+    }
+    if (size_ - offset_ < frame_size) {
+      return nullptr;
+    }
+    *payload = buffer_.get() + offset_ + header_size;
+    if ((frame_.flags & kFlagChecksum) && crc32c(0, *payload, frame_.length) != frame_.checksum) {
+      Log::error("Checksum mismatch in a frame of %u bytes at index %u", frame_.length, frame_.index);
+      is_corrupt_ = true;
+      return nullptr;
+    }
+    offset_ += frame_size;
+    return &frame_;
+  }
+
+  // Move the partial frame, if any, to the front.
+  void compact() {
+    if (offset_ == 0) {
+      return;
+    }
+    size_ -= offset_;
+    memmove(buffer_.get(), buffer_.get() + offset_, size_);
+    offset_ = 0;
+  }
+
+  bool is_corrupt() const { return is_corrupt_; }
+
+ private:
+  const size_t capacity_;
+  std::unique_ptr<char[]> buffer_;
+  size_t size_{0};
+  size_t offset_{0};
+  bool is_corrupt_{false};
+  Frame frame_;
+};
+
+// Log-linear histogram in the HDR style: every power of two is split into kSubBuckets linear buckets, so any
+// value is kept within 1/kSubBuckets of its size. Recording is a relaxed atomic increment, any thread may add while
+// another one takes snapshots.
+class Hist {
+ public:
+  inline static const uint32_t kSubBits = 5;
+  inline static const uint32_t kSubBuckets = 1u << kSubBits;
+  inline static const uint32_t kBuckets = (64 - kSubBits + 1) * kSubBuckets;
+
+  // Plain copy of the counts, snapshots of several histograms merge into one.
+  struct Snapshot {
+    std::vector<uint64_t> counts = std::vector<uint64_t>(kBuckets, 0);
+    uint64_t count{0};
+    uint64_t sum{0};
+    uint64_t min{std::numeric_limits<uint64_t>::max()};
+    uint64_t max{0};
+
+    void merge(const Snapshot &other) {
+      for (uint32_t i = 0; i < kBuckets; ++i) {
+        counts[i] += other.counts[i];
+      }
+      count += other.count;
+      sum += other.sum;
+      min = std::min(min, other.min);
+      max = std::max(max, other.max);
+    }
+
+    uint64_t mean() const { return (count == 0) ? 0 : sum / count; }
+
+    // Highest value of the bucket holding the `quantile` share of the values, at most the largest value seen.
+    uint64_t percentile(double quantile) const {
+      if (count == 0) {
+        return 0;
+      }
+      const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(quantile * count + 0.5));
+      uint64_t seen = 0;
+      for (uint32_t i = 0; i < kBuckets; ++i) {
+        seen += counts[i];
+        if (seen >= rank) {
+          return std::min(max, upper_(i));
+        }
+      }
+      return max;
+    }
+
+    std::string to_json() const {
+      char buffer[256];
+      snprintf(buffer, sizeof(buffer),
+               "{\"count\":%lu,\"min\":%lu,\"mean\":%lu,\"p50\":%lu,\"p99\":%lu,\"p999\":%lu,\"max\":%lu}", count,
+               (count == 0) ? 0 : min, mean(), percentile(0.5), percentile(0.99), percentile(0.999), max);
+      return buffer;
+    }
+  };
+
+  Hist(const std::string &name) : name_(name), counts_(std::make_unique<std::atomic<uint64_t>[]>(kBuckets)) {}
+
+  const std::string &name() const { return name_; }
+
+  void add(uint64_t value) {
+    counts_[index_(value)].fetch_add(1, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(value, std::memory_order_relaxed);
+    uint64_t min = min_.load(std::memory_order_relaxed);
+    while (value < min && !min_.compare_exchange_weak(min, value, std::memory_order_relaxed)) {
+    }
+    uint64_t max = max_.load(std::memory_order_relaxed);
+    while (value > max && !max_.compare_exchange_weak(max, value, std::memory_order_relaxed)) {
+    }
+  }
+
+  // signed samples, such as delays across hosts with skewed clocks, count as 0 when negative
+  void add_signed(int64_t value) { add(static_cast<uint64_t>(std::max<int64_t>(0, value))); }
+
+  Snapshot snapshot() const {
+    Snapshot result;
+    for (uint32_t i = 0; i < kBuckets; ++i) {
+      result.counts[i] = counts_[i].load(std::memory_order_relaxed);
+    }
+    result.count = count_.load(std::memory_order_relaxed);
+    result.sum = sum_.load(std::memory_order_relaxed);
+    result.min = min_.load(std::memory_order_relaxed);
+    result.max = max_.load(std::memory_order_relaxed);
+    return result;
+  }
+
+ private:
+  static uint32_t index_(uint64_t value) {
+    if (value < kSubBuckets) {
+      return value;
+    }
+    const uint32_t shift = 63 - __builtin_clzll(value) - kSubBits;
+    return (shift + 1) * kSubBuckets + ((value >> shift) & (kSubBuckets - 1));
   }
 
-  std::vector<uint64_t> get() const { return hist_; }
-  Tp min() const { return min_; }
-  Tp max() const { return max_; }
-  Tp mean() const { return mean_; }
-  void print() const {
-    Log::debug("Hist of %s (min:%lu max:%lu mean:%lu count:%lu), histogram:", name_.c_str(), min_, max_, mean_, count_);
-    for (size_t i = 0; i < hist_.size(); ++i) {
-      Log::debug("  %s: %lu(%.2lf%)",
-                 (i >= hist_delimiters_.size()) ? "overflow" : std::to_string(hist_delimiters_[i]).c_str(), hist_[i],
-                 100.0 * static_cast<double>(hist_[i]) / static_cast<double>(count_));
+  static uint64_t upper_(uint32_t index) {
+    if (index < kSubBuckets) {
+      return index;
     }
+    const uint32_t shift = index / kSubBuckets - 1;
+    const uint64_t lower = static_cast<uint64_t>(kSubBuckets + index % kSubBuckets) << shift;
+    return lower + ((uint64_t{1} << shift) - 1);
   }
 
  private:
   std::string name_{""};
-  std::vector<Tp> hist_delimiters_;
-  std::vector<uint64_t> hist_;
-  Tp min_{std::numeric_limits<Tp>::max()};
-  Tp max_{std::numeric_limits<Tp>::min()};
-  Tp mean_{0};
-  uint64_t count_{0};
+  std::unique_ptr<std::atomic<uint64_t>[]> counts_;
+  std::atomic<uint64_t> count_{0};
+  std::atomic<uint64_t> sum_{0};
+  std::atomic<uint64_t> min_{std::numeric_limits<uint64_t>::max()};
+  std::atomic<uint64_t> max_{0};
 };
 
 #endif  // CHANNEL_UTILS_H